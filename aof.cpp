@@ -0,0 +1,248 @@
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "aof.hpp"
+
+static struct {
+    // guards the buffers below. taken under a shard lock, keep it short.
+    std::mutex mu;
+    std::vector<uint8_t> buf;     // fed, not written yet.
+    std::vector<uint8_t> rewrite; // fed since the rewrite started.
+    bool rewriting = false;
+    uint64_t fed = 0;             // bytes ever fed, a position in the stream.
+    // serializes writing to and swapping `fd`, never taken under `mu`.
+    std::mutex io_mu;
+    int fd = -1;
+    std::atomic<uint64_t> written{0}; // stream position in the file...
+    std::atomic<uint64_t> synced{0};  // ...and on disk.
+    std::atomic<uint64_t> size{0};    // of the file.
+    uint64_t base = 0;                // size after the last rewrite.
+    AofFsync policy = AOF_FSYNC_EVERYSEC;
+    std::string path;
+} g_aof;
+
+// the stream position this thread has to see written (and maybe synced).
+static thread_local uint64_t t_aof_fed = 0;
+
+static void put_u32(std::vector<uint8_t> &out, uint32_t v) {
+    out.insert(out.end(), (const uint8_t *)&v, (const uint8_t *)&v + 4);
+}
+
+void aof_encode(std::vector<uint8_t> &out, const std::string_view *args, size_t nargs) {
+    size_t len = 4;
+    for (size_t i = 0; i < nargs; i++) {
+        len += 4 + args[i].size();
+    }
+    put_u32(out, (uint32_t)len);
+    put_u32(out, (uint32_t)nargs);
+    for (size_t i = 0; i < nargs; i++) {
+        put_u32(out, (uint32_t)args[i].size());
+        out.insert(out.end(), args[i].begin(), args[i].end());
+    }
+}
+
+// `nwritten`, if given, gets the bytes written before a failure.
+static bool write_all(int fd, const uint8_t *data, size_t len, size_t *nwritten = nullptr) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t rv = write(fd, data + done, len - done);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            break;
+        }
+        done += (size_t)rv;
+    }
+    if (nwritten) {
+        *nwritten = done;
+    }
+    return done == len;
+}
+
+// positions only move forward, even when the fsync thread finishes late.
+static void advance(std::atomic<uint64_t> &pos, uint64_t upto) {
+    uint64_t curr = pos.load();
+    while (curr < upto && !pos.compare_exchange_weak(curr, upto)) {
+    }
+}
+
+static void aof_fsync_run() {
+    while (true) {
+        sleep(1);
+        int fd = -1;
+        uint64_t upto = 0;
+        {
+            // a dup stays valid even if a rewrite swaps the log meanwhile.
+            std::lock_guard<std::mutex> lock(g_aof.io_mu);
+            upto = g_aof.written.load();
+            if (upto != g_aof.synced.load()) {
+                fd = dup(g_aof.fd);
+            }
+        }
+        if (fd >= 0 && fdatasync(fd) == 0) {
+            advance(g_aof.synced, upto);
+        } else if (fd >= 0) {
+            fprintf(stderr, "aof fdatasync() failed: %s\n", strerror(errno)); // retried next second.
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+bool aof_open(const char *path, AofFsync policy) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    g_aof.fd = fd;
+    g_aof.path = path;
+    g_aof.policy = policy;
+    g_aof.size = g_aof.base = (uint64_t)size;
+    if (policy == AOF_FSYNC_EVERYSEC) {
+        std::thread(aof_fsync_run).detach();
+    }
+    return true;
+}
+
+bool aof_enabled() {
+    return g_aof.fd >= 0;
+}
+
+void aof_feed(const std::string_view *args, size_t nargs) {
+    if (g_aof.fd < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_aof.mu);
+    size_t start = g_aof.buf.size();
+    aof_encode(g_aof.buf, args, nargs);
+    size_t len = g_aof.buf.size() - start;
+    if (g_aof.rewriting) {
+        g_aof.rewrite.insert(g_aof.rewrite.end(), g_aof.buf.begin() + start, g_aof.buf.end());
+    }
+    g_aof.fed += len;
+    t_aof_fed = g_aof.fed;
+}
+
+// with io_mu held.
+static void aof_write_locked() {
+    static std::vector<uint8_t> pending; // only touched under io_mu.
+    uint64_t upto = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_aof.mu);
+        pending.swap(g_aof.buf);
+        upto = g_aof.fed;
+    }
+    if (pending.empty()) {
+        return;
+    }
+    size_t done = 0;
+    if (!write_all(g_aof.fd, pending.data(), pending.size(), &done)) {
+        // keep the rest, in order, for the next attempt: the bytes that made
+        // it are a prefix of the stream, the retry completes the record.
+        fprintf(stderr, "aof write() failed: %s\n", strerror(errno));
+        g_aof.size += done;
+        pending.erase(pending.begin(), pending.begin() + done);
+        std::lock_guard<std::mutex> lock(g_aof.mu);
+        pending.insert(pending.end(), g_aof.buf.begin(), g_aof.buf.end());
+        pending.swap(g_aof.buf);
+        pending.clear();
+        return;
+    }
+    g_aof.size += pending.size();
+    pending.clear();
+    g_aof.written.store(upto);
+}
+
+void aof_flush() {
+    if (g_aof.fd < 0 || t_aof_fed <= g_aof.synced.load(std::memory_order_relaxed)) {
+        return;
+    }
+    bool always = g_aof.policy == AOF_FSYNC_ALWAYS;
+    if (!always && t_aof_fed <= g_aof.written.load(std::memory_order_relaxed)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_aof.io_mu);
+    // another thread may have flushed our records while we waited.
+    if (t_aof_fed > g_aof.written.load()) {
+        aof_write_locked();
+    }
+    uint64_t upto = g_aof.written.load();
+    if (!always) {
+        return;
+    }
+    // the replies held for these records must never go out, and there is
+    // no telling what of the file reached the disk: give up, like redis.
+    if (upto < t_aof_fed) {
+        fprintf(stderr, "aof write() failed under appendfsync always, exiting\n");
+        exit(1);
+    }
+    if (upto > g_aof.synced.load() && fdatasync(g_aof.fd) != 0) {
+        fprintf(stderr, "aof fdatasync() failed under appendfsync always: %s, exiting\n",
+                strerror(errno));
+        exit(1);
+    }
+    advance(g_aof.synced, upto);
+}
+
+bool aof_durable() {
+    if (g_aof.policy != AOF_FSYNC_ALWAYS) {
+        return true;
+    }
+    return t_aof_fed <= g_aof.synced.load(std::memory_order_relaxed);
+}
+
+uint64_t aof_size() {
+    return g_aof.size.load(std::memory_order_relaxed);
+}
+
+uint64_t aof_base_size() {
+    std::lock_guard<std::mutex> lock(g_aof.io_mu);
+    return g_aof.base;
+}
+
+void aof_rewrite_begin() {
+    std::lock_guard<std::mutex> lock(g_aof.mu);
+    g_aof.rewriting = true;
+    g_aof.rewrite.clear();
+}
+
+bool aof_rewrite_end(const char *tmp_path, bool ok) {
+    std::lock_guard<std::mutex> io_lock(g_aof.io_mu);
+    // the live log gets everything fed so far, and with `mu` held nothing
+    // new arrives: the records set aside are exactly what the child missed.
+    aof_write_locked();
+    std::lock_guard<std::mutex> lock(g_aof.mu);
+    g_aof.rewriting = false;
+    std::vector<uint8_t> rewrite;
+    rewrite.swap(g_aof.rewrite);
+    if (!ok || !g_aof.buf.empty()) {
+        unlink(tmp_path);
+        return false; // the live log could not be written, keep it.
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    if (!write_all(fd, rewrite.data(), rewrite.size()) || fdatasync(fd) != 0
+        || rename(tmp_path, g_aof.path.c_str()) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        return false;
+    }
+    close(g_aof.fd);
+    g_aof.fd = fd;
+    g_aof.size = g_aof.base = (uint64_t)lseek(fd, 0, SEEK_END);
+    advance(g_aof.synced, g_aof.written.load()); // all of it is in the new file.
+    return true;
+}
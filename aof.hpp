@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// the append-only file: every command that changed the keyspace, in the
+// same framing clients send, so replaying it is just parsing requests.
+enum AofFsync {
+    AOF_FSYNC_NO = 0,       // leave it to the kernel.
+    AOF_FSYNC_EVERYSEC = 1, // a background thread, once a second.
+    AOF_FSYNC_ALWAYS = 2,   // before the replies of the loop turn go out.
+};
+
+// one request: [4B len][4B nstr]([4B len][bytes])*.
+void aof_encode(std::vector<uint8_t> &out, const std::string_view *args, size_t nargs);
+
+// opens `path` for appending, call once the log has been replayed.
+bool aof_open(const char *path, AofFsync policy);
+bool aof_enabled();
+
+// called with the key's shard lock held, so the log has the same order of
+// changes as the keyspace. only copies into a memory buffer.
+void aof_feed(const std::string_view *args, size_t nargs);
+inline void aof_feed(const std::vector<std::string_view> &args) {
+    aof_feed(args.data(), args.size());
+}
+
+// once per loop turn: writes what has been fed (by any thread) in one
+// write(), followed by an fsync under AOF_FSYNC_ALWAYS. group commit.
+// under AOF_FSYNC_ALWAYS, a failed write or fsync exits the process.
+void aof_flush();
+// false while the records this thread fed are not as durable as the policy
+// wants, its replies have to wait for the next aof_flush().
+bool aof_durable();
+
+// bytes in the log, and right after the last rewrite.
+uint64_t aof_size();
+uint64_t aof_base_size();
+
+// rewriting: the caller snapshots the keyspace while holding every shard
+// lock and calls aof_rewrite_begin() before releasing them; from then on
+// fed records are kept aside as well. aof_rewrite_end() appends them to
+// the compacted log at `tmp_path` and renames it over the live one, or just
+// drops them if the rewrite failed.
+void aof_rewrite_begin();
+bool aof_rewrite_end(const char *tmp_path, bool ok);
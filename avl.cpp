@@ -0,0 +1,156 @@
+#include<algorithm>
+#include"avl.hpp"
+
+static void avl_update(AVLNode* node){
+    node->height = 1 + std::max(avl_height(node->left), avl_height(node->right));
+    node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
+}
+
+static AVLNode* rot_left(AVLNode* node){
+    AVLNode* parent = node->parent;
+    AVLNode* new_node = node->right;
+    AVLNode* inner = new_node->left;
+    node->right = inner;
+    if(inner){
+        inner->parent = node;
+    }
+    new_node->parent = parent; // the caller relinks the parent.
+    new_node->left = node;
+    node->parent = new_node;
+    avl_update(node);
+    avl_update(new_node);
+    return new_node;
+}
+
+static AVLNode* rot_right(AVLNode* node){
+    AVLNode* parent = node->parent;
+    AVLNode* new_node = node->left;
+    AVLNode* inner = new_node->right;
+    node->left = inner;
+    if(inner){
+        inner->parent = node;
+    }
+    new_node->parent = parent;
+    new_node->right = node;
+    node->parent = new_node;
+    avl_update(node);
+    avl_update(new_node);
+    return new_node;
+}
+
+// the left subtree is taller by 2.
+static AVLNode* avl_fix_left(AVLNode* node){
+    if(avl_height(node->left->left) < avl_height(node->left->right)){
+        node->left = rot_left(node->left);
+    }
+    return rot_right(node);
+}
+
+// the right subtree is taller by 2.
+static AVLNode* avl_fix_right(AVLNode* node){
+    if(avl_height(node->right->right) < avl_height(node->right->left)){
+        node->right = rot_right(node->right);
+    }
+    return rot_left(node);
+}
+
+AVLNode* avl_fix(AVLNode* node){
+    while(true){
+        AVLNode** from = &node; // where to attach the fixed subtree.
+        AVLNode* parent = node->parent;
+        if(parent){
+            from = parent->left == node ? &parent->left : &parent->right;
+        }
+        avl_update(node);
+        uint32_t l = avl_height(node->left);
+        uint32_t r = avl_height(node->right);
+        if(l == r + 2){
+            *from = avl_fix_left(node);
+        }else if(l + 2 == r){
+            *from = avl_fix_right(node);
+        }
+        if(!parent){
+            return *from;
+        }
+        node = parent;
+    }
+}
+
+// unlink a node that has at most one child.
+static AVLNode* avl_del_easy(AVLNode* node){
+    AVLNode* child = node->left ? node->left : node->right;
+    AVLNode* parent = node->parent;
+    if(child){
+        child->parent = parent;
+    }
+    if(!parent){
+        return child;
+    }
+    AVLNode** from = parent->left == node ? &parent->left : &parent->right;
+    *from = child;
+    return avl_fix(parent);
+}
+
+AVLNode* avl_del(AVLNode* node){
+    if(!node->left || !node->right){
+        return avl_del_easy(node);
+    }
+    // swap in the successor, which has no left child.
+    AVLNode* victim = node->right;
+    while(victim->left){
+        victim = victim->left;
+    }
+    AVLNode* root = avl_del_easy(victim);
+    *victim = *node;
+    if(victim->left){
+        victim->left->parent = victim;
+    }
+    if(victim->right){
+        victim->right->parent = victim;
+    }
+    AVLNode** from = &root;
+    if(AVLNode* parent = node->parent){
+        from = parent->left == node ? &parent->left : &parent->right;
+    }
+    *from = victim;
+    return root;
+}
+
+// walks up and down the tree using the subtree counts, O(log n).
+AVLNode* avl_offset(AVLNode* node, int64_t offset){
+    int64_t pos = 0; // rank of `node` relative to the starting node.
+    while(offset != pos){
+        if(pos < offset && pos + avl_cnt(node->right) >= offset){
+            // the target is inside the right subtree.
+            node = node->right;
+            pos += avl_cnt(node->left) + 1;
+        }else if(pos > offset && pos - avl_cnt(node->left) <= offset){
+            // the target is inside the left subtree.
+            node = node->left;
+            pos -= avl_cnt(node->right) + 1;
+        }else{
+            // go to the parent.
+            AVLNode* parent = node->parent;
+            if(!parent){
+                return nullptr;
+            }
+            if(parent->right == node){
+                pos -= avl_cnt(node->left) + 1;
+            }else{
+                pos += avl_cnt(node->right) + 1;
+            }
+            node = parent;
+        }
+    }
+    return node;
+}
+
+int64_t avl_rank(AVLNode* node){
+    int64_t rank = avl_cnt(node->left);
+    for(; node->parent; node = node->parent){
+        if(node->parent->right == node){
+            rank += avl_cnt(node->parent->left) + 1;
+        }
+    }
+    return rank;
+}
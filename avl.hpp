@@ -0,0 +1,33 @@
+#pragma once
+#include<cstddef>
+#include<cstdint>
+
+// intrusive AVL tree. every node also counts the nodes of its subtree, which
+// makes rank and offset queries O(log n) (an order-statistic tree). the
+// tree does not know the key: callers walk it to find the insert position,
+// link the node and call avl_fix().
+struct AVLNode{
+    AVLNode* parent = nullptr;
+    AVLNode* left = nullptr;
+    AVLNode* right = nullptr;
+    uint32_t height = 1;
+    uint32_t cnt = 1;    // size of the subtree rooted here.
+};
+
+inline void avl_init(AVLNode* node){
+    node->parent = node->left = node->right = nullptr;
+    node->height = 1;
+    node->cnt = 1;
+}
+
+inline uint32_t avl_height(AVLNode* node){ return node ? node->height : 0; }
+inline uint32_t avl_cnt(AVLNode* node){ return node ? node->cnt : 0; }
+
+// rebalance from a freshly linked (or changed) node up, returns the new root.
+AVLNode* avl_fix(AVLNode* node);
+// unlink `node`, returns the new root (nullptr if the tree is now empty).
+AVLNode* avl_del(AVLNode* node);
+// the node `offset` positions after (or before, if negative) `node`.
+AVLNode* avl_offset(AVLNode* node, int64_t offset);
+// 0-based position of `node` in the whole tree.
+int64_t avl_rank(AVLNode* node);
@@ -0,0 +1,468 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "histogram.hpp"
+#include "proto.hpp"
+
+using namespace std;
+
+// load generator for the server: a fixed number of connections, each keeping
+// `pipeline` GET/SET requests in flight over uniformly random keys. latency is
+// measured per request from the moment it is queued to the moment its reply
+// is parsed, so pipelined requests include the time spent waiting in line.
+// run with `make bench [BENCH_ARGS=...]` or against any server directly.
+
+enum {
+    TAG_ERR = 1,
+};
+
+struct Options {
+    string host = "127.0.0.1";
+    int port = 1234;
+    int connections = 50;
+    int pipeline = 1;
+    int threads = 1;
+    uint64_t keyspace = 100000;
+    size_t value_size = 32;
+    uint32_t get_weight = 9;
+    uint32_t set_weight = 1;
+    double duration = 10;
+    bool prefill = false;
+};
+
+static uint64_t now_ns() {
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void die(const char* msg) {
+    fprintf(stderr, "[%d] %s\n", errno, msg);
+    exit(1);
+}
+
+// one request waiting for its reply.
+struct Pending {
+    uint64_t sent_ns = 0;
+    bool is_set = false;
+};
+
+struct Conn {
+    int fd = -1;
+    vector<uint8_t> out;
+    size_t out_pos = 0;
+    bool want_write = false;
+    vector<uint8_t> in;
+    size_t in_pos = 0;
+    // replies come back in request order, so a ring of `pipeline` slots.
+    vector<Pending> ring;
+    size_t ring_head = 0;
+    size_t inflight = 0;
+    uint64_t rng = 0;
+};
+
+struct Worker {
+    vector<Conn> conns;
+    Histogram get_hist;
+    Histogram set_hist;
+    uint64_t errors = 0;
+    uint64_t disconnects = 0;
+};
+
+static uint64_t xorshift(uint64_t& s) {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+static string g_value;
+
+static int connect_to(const Options& opt) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad host address: %s\n", opt.host.c_str());
+        exit(1);
+    }
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        die("connect()");
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int format_key(char* buf, uint64_t k) {
+    return snprintf(buf, 32, "key:%012llu", (unsigned long long)k);
+}
+
+static void queue_request(const Options& opt, Conn& c, uint64_t now) {
+    char key[32];
+    uint64_t r = xorshift(c.rng);
+    int klen = format_key(key, r % opt.keyspace);
+    bool is_set = (r >> 32) % (opt.get_weight + opt.set_weight) >= opt.get_weight;
+    if (is_set) {
+        string_view args[] = {"set", string_view(key, klen), g_value};
+        append_request(c.out, args, 3);
+    } else {
+        string_view args[] = {"get", string_view(key, klen)};
+        append_request(c.out, args, 2);
+    }
+    Pending& p = c.ring[(c.ring_head + c.inflight) % c.ring.size()];
+    p.sent_ns = now;
+    p.is_set = is_set;
+    c.inflight++;
+}
+
+// false if the connection is gone.
+static bool flush_out(Conn& c) {
+    while (c.out_pos < c.out.size()) {
+        ssize_t rv = write(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return true;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        c.out_pos += rv;
+    }
+    c.out.clear();
+    c.out_pos = 0;
+    return true;
+}
+
+// parses every complete reply in the input buffer.
+static void parse_replies(Worker& w, Conn& c, uint64_t now) {
+    while (c.in.size() - c.in_pos >= 4) {
+        uint32_t len;
+        memcpy(&len, &c.in[c.in_pos], 4);
+        if (c.in.size() - c.in_pos - 4 < len) {
+            break;
+        }
+        const uint8_t* payload = &c.in[c.in_pos + 4];
+        if (c.inflight > 0) {
+            Pending& p = c.ring[c.ring_head];
+            c.ring_head = (c.ring_head + 1) % c.ring.size();
+            c.inflight--;
+            (p.is_set ? w.set_hist : w.get_hist).record(now - p.sent_ns);
+        }
+        if (len > 0 && payload[0] == TAG_ERR) {
+            w.errors++;
+        }
+        c.in_pos += 4 + len;
+    }
+    if (c.in_pos == c.in.size()) {
+        c.in.clear();
+        c.in_pos = 0;
+    } else if (c.in_pos > 64 * 1024) {
+        c.in.erase(c.in.begin(), c.in.begin() + c.in_pos);
+        c.in_pos = 0;
+    }
+}
+
+static bool read_in(Conn& c) {
+    while (true) {
+        size_t old = c.in.size();
+        c.in.resize(old + 64 * 1024);
+        ssize_t rv = read(c.fd, c.in.data() + old, 64 * 1024);
+        if (rv < 0 && errno == EINTR) {
+            c.in.resize(old);
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            c.in.resize(old);
+            return true;
+        }
+        if (rv <= 0) {
+            c.in.resize(old);
+            return false;
+        }
+        c.in.resize(old + rv);
+        if (rv < 64 * 1024) {
+            return true;
+        }
+    }
+}
+
+static void watch(int epfd, Conn& c, size_t idx, bool want_write) {
+    if (c.want_write == want_write) {
+        return;
+    }
+    c.want_write = want_write;
+    epoll_event ev{};
+    ev.events = EPOLLIN | (want_write ? (uint32_t)EPOLLOUT : 0);
+    ev.data.u64 = idx;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+static void close_conn(Worker& w, Conn& c) {
+    close(c.fd);
+    c.fd = -1;
+    c.inflight = 0;
+    w.disconnects++;
+}
+
+// tops the pipeline up and sends whatever is queued.
+static void pump(const Options& opt, Worker& w, int epfd, size_t idx, uint64_t now, bool issuing) {
+    Conn& c = w.conns[idx];
+    if (issuing) {
+        while (c.inflight < (size_t)opt.pipeline) {
+            queue_request(opt, c, now);
+        }
+    }
+    if (!flush_out(c)) {
+        close_conn(w, c);
+        return;
+    }
+    watch(epfd, c, idx, !c.out.empty());
+}
+
+static void worker_run(const Options& opt, Worker& w, uint64_t start, uint64_t deadline) {
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        die("epoll_create1()");
+    }
+    for (size_t i = 0; i < w.conns.size(); i++) {
+        Conn& c = w.conns[i];
+        fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+    while (now_ns() < start) {
+        // every thread starts the clock together.
+    }
+    for (size_t i = 0; i < w.conns.size(); i++) {
+        pump(opt, w, epfd, i, now_ns(), true);
+    }
+    vector<epoll_event> events(w.conns.size());
+    while (true) {
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            break;
+        }
+        int timeout_ms = (int)((deadline - now) / 1000000) + 1;
+        int n = epoll_wait(epfd, events.data(), events.size(), timeout_ms);
+        if (n < 0 && errno != EINTR) {
+            die("epoll_wait()");
+        }
+        now = now_ns();
+        bool issuing = now < deadline;
+        for (int i = 0; i < n; i++) {
+            size_t idx = events[i].data.u64;
+            Conn& c = w.conns[idx];
+            if (c.fd < 0) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                bool ok = read_in(c);
+                parse_replies(w, c, now);
+                if (!ok) {
+                    close_conn(w, c);
+                    continue;
+                }
+            }
+            pump(opt, w, epfd, idx, now, issuing);
+        }
+    }
+    // replies still in flight at the deadline are not counted.
+    for (Conn& c : w.conns) {
+        if (c.fd >= 0) {
+            close(c.fd);
+        }
+    }
+    close(epfd);
+}
+
+// writes every key once with one MSET per batch over a blocking connection.
+static void prefill(const Options& opt) {
+    int fd = connect_to(opt);
+    const uint64_t k_batch = 1024;
+    vector<char> keys(k_batch * 32);
+    vector<string_view> args;
+    vector<uint8_t> out;
+    for (uint64_t base = 0; base < opt.keyspace; base += k_batch) {
+        uint64_t n = min(k_batch, opt.keyspace - base);
+        args.assign(1, "mset");
+        for (uint64_t i = 0; i < n; i++) {
+            char* key = &keys[i * 32];
+            args.emplace_back(key, format_key(key, base + i));
+            args.emplace_back(g_value);
+        }
+        out.clear();
+        append_request(out, args.data(), args.size());
+        for (size_t off = 0; off < out.size();) {
+            ssize_t rv = write(fd, out.data() + off, out.size() - off);
+            if (rv <= 0) {
+                die("write()");
+            }
+            off += rv;
+        }
+        uint32_t len = 0;
+        uint8_t tag = 0;
+        if (read(fd, &len, 4) != 4 || len == 0 || read(fd, &tag, 1) != 1) {
+            die("read()");
+        }
+        vector<uint8_t> rest(len - 1);
+        for (size_t off = 0; off < rest.size();) {
+            ssize_t rv = read(fd, rest.data() + off, rest.size() - off);
+            if (rv <= 0) {
+                die("read()");
+            }
+            off += rv;
+        }
+        if (tag == TAG_ERR) {
+            fprintf(stderr, "prefill: mset failed\n");
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+static void print_latency(const char* label, const Histogram& h) {
+    if (h.total == 0) {
+        return;
+    }
+    static const double k_points[] = {50, 90, 99, 99.9, 99.99};
+    printf("%-4s", label);
+    for (double p : k_points) {
+        printf("  p%-5g %8.1f", p, h.percentile(p) / 1000.0);
+    }
+    printf("  max %8.1f us\n", h.max / 1000.0);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -h, --host ADDR        server address (127.0.0.1)\n"
+        "  -p, --port PORT        server port (1234)\n"
+        "  -c, --connections N    concurrent connections (50)\n"
+        "  -P, --pipeline N       requests in flight per connection (1)\n"
+        "  -T, --threads N        client threads sharing the connections (1)\n"
+        "  -k, --keyspace N       number of distinct keys (100000)\n"
+        "  -d, --value-size N     bytes per SET value (32)\n"
+        "  -r, --ratio GET:SET    request mix (9:1)\n"
+        "  -t, --duration SEC     length of the run (10)\n"
+        "      --prefill          SET every key before the run\n",
+        prog);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    static const option k_long[] = {
+        {"host", required_argument, nullptr, 'h'},
+        {"port", required_argument, nullptr, 'p'},
+        {"connections", required_argument, nullptr, 'c'},
+        {"pipeline", required_argument, nullptr, 'P'},
+        {"threads", required_argument, nullptr, 'T'},
+        {"keyspace", required_argument, nullptr, 'k'},
+        {"value-size", required_argument, nullptr, 'd'},
+        {"ratio", required_argument, nullptr, 'r'},
+        {"duration", required_argument, nullptr, 't'},
+        {"prefill", no_argument, nullptr, 'F'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int ch;
+    while ((ch = getopt_long(argc, argv, "h:p:c:P:T:k:d:r:t:", k_long, nullptr)) != -1) {
+        switch (ch) {
+            case 'h': opt.host = optarg; break;
+            case 'p': opt.port = atoi(optarg); break;
+            case 'c': opt.connections = atoi(optarg); break;
+            case 'P': opt.pipeline = atoi(optarg); break;
+            case 'T': opt.threads = atoi(optarg); break;
+            case 'k': opt.keyspace = strtoull(optarg, nullptr, 10); break;
+            case 'd': opt.value_size = strtoull(optarg, nullptr, 10); break;
+            case 'r':
+                if (sscanf(optarg, "%u:%u", &opt.get_weight, &opt.set_weight) != 2) {
+                    usage(argv[0]);
+                }
+                break;
+            case 't': opt.duration = atof(optarg); break;
+            case 'F': opt.prefill = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (opt.connections < 1 || opt.pipeline < 1 || opt.threads < 1 || opt.keyspace == 0
+        || opt.get_weight + opt.set_weight == 0 || opt.duration <= 0) {
+        usage(argv[0]);
+    }
+    if (opt.threads > opt.connections) {
+        opt.threads = opt.connections;
+    }
+    g_value.assign(opt.value_size, 'x');
+
+    if (opt.prefill) {
+        uint64_t t0 = now_ns();
+        prefill(opt);
+        printf("prefill: %llu keys in %.2f s\n",
+            (unsigned long long)opt.keyspace, (now_ns() - t0) / 1e9);
+    }
+
+    // connections are dealt round-robin to the threads.
+    vector<Worker> workers(opt.threads);
+    for (int i = 0; i < opt.connections; i++) {
+        Conn c;
+        c.fd = connect_to(opt);
+        c.ring.resize(opt.pipeline);
+        c.rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        workers[i % opt.threads].conns.push_back(move(c));
+    }
+
+    uint64_t start = now_ns() + 10000000;
+    uint64_t deadline = start + (uint64_t)(opt.duration * 1e9);
+    vector<thread> threads;
+    for (Worker& w : workers) {
+        threads.emplace_back(worker_run, cref(opt), ref(w), start, deadline);
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+
+    Histogram get_hist, set_hist, all;
+    uint64_t errors = 0, disconnects = 0;
+    for (Worker& w : workers) {
+        get_hist.merge(w.get_hist);
+        set_hist.merge(w.set_hist);
+        errors += w.errors;
+        disconnects += w.disconnects;
+    }
+    all.merge(get_hist);
+    all.merge(set_hist);
+
+    double secs = (deadline - start) / 1e9;
+    printf("%d connections, pipeline %d, %d threads, %llu keys, %zu byte values, get:set %u:%u\n",
+        opt.connections, opt.pipeline, opt.threads, (unsigned long long)opt.keyspace,
+        opt.value_size, opt.get_weight, opt.set_weight);
+    printf("%.0f ops/sec over %.1f s (get %.0f, set %.0f), %llu errors, %llu disconnects\n",
+        all.total / secs, secs, get_hist.total / secs, set_hist.total / secs,
+        (unsigned long long)errors, (unsigned long long)disconnects);
+    printf("latency (us):\n");
+    print_latency("all", all);
+    print_latency("get", get_hist);
+    print_latency("set", set_hist);
+    return 0;
+}
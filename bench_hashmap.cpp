@@ -0,0 +1,257 @@
+#include<bits/stdc++.h>
+#include"hashmap.hpp"
+#include"histogram.hpp"
+using namespace std;
+
+// measures the hashmap backends without the server: insert, lookup (hit and
+// miss), for_each and delete at each size given on the command line (1K, 50M
+// ...). every operation is run twice, once back to back for ns/op and the
+// allocations per op, and once timed one by one for the latency tail, which
+// is where a table that resizes in one go shows its spikes.
+//   make bench-hashmap [SIZES="1K 1M"]     all sizes, both backends
+//   make bench-hmap-compare [N=1000000]    one size, both backends
+
+#ifdef LOOPDB_HMAP_SWISS
+static const char* k_backend = "swiss";
+#else
+static const char* k_backend = "chain";
+#endif
+
+// counts the calls into the allocator, forwarding them to glibc's.
+static uint64_t g_allocs = 0;
+
+extern "C" {
+void* __libc_malloc(size_t n);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t n);
+void __libc_free(void* p);
+
+void* malloc(size_t n) noexcept { g_allocs++; return __libc_malloc(n); }
+void* calloc(size_t n, size_t size) noexcept { g_allocs++; return __libc_calloc(n, size); }
+void* realloc(void* p, size_t n) noexcept { g_allocs++; return __libc_realloc(p, n); }
+void free(void* p) noexcept { __libc_free(p); }
+}
+
+struct Item{
+    HashNode node;
+    uint64_t key = 0;
+};
+
+#define container_of(ptr, T, member) \
+    ((T *)((char *)ptr - offsetof(T, member)))
+
+static bool item_eq(HashNode* lhs, HashNode* rhs){
+    return container_of(lhs, Item, node)->key == container_of(rhs, Item, node)->key;
+}
+
+// splitmix64, a stand-in for the server's key hash.
+static uint64_t mix(uint64_t x){
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t now_ns(){
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+enum{ OP_INSERT, OP_HIT, OP_MISS, OP_FOR_EACH, OP_DELETE, OP_COUNT };
+
+static const char* k_op_names[OP_COUNT] = {
+    "insert", "lookup-hit", "lookup-miss", "for_each", "delete",
+};
+
+struct Result{
+    uint64_t ops = 0;
+    uint64_t ns = 0;
+    uint64_t allocs = 0;
+    Histogram lat;
+};
+
+// the latency pass wraps every operation in a pair of clock reads.
+template<bool Timed, class F>
+static inline void step(Result& r, F&& f){
+    if(Timed){
+        uint64_t t0 = now_ns();
+        f();
+        r.lat.record(now_ns() - t0);
+    }else{
+        f();
+    }
+}
+
+struct Phase{
+    Result& r;
+    uint64_t t0 = now_ns();
+    uint64_t a0 = g_allocs;
+    size_t n;
+
+    Phase(Result& r, size_t n) : r(r), n(n) {}
+    ~Phase(){
+        r.ns += now_ns() - t0;
+        r.allocs += g_allocs - a0;
+        r.ops += n;
+    }
+};
+
+struct ForEachArg{
+    Histogram* lat = nullptr;
+    uint64_t last = 0;
+    size_t seen = 0;
+};
+
+static bool cb_count(HashNode*, void* arg){
+    ((ForEachArg*)arg)->seen++;
+    return true;
+}
+
+// for_each has no per-key call to time, so the gap between two callbacks
+// stands in for the cost of visiting one key.
+static bool cb_gap(HashNode*, void* arg){
+    ForEachArg* fa = (ForEachArg*)arg;
+    uint64_t now = now_ns();
+    fa->lat->record(now - fa->last);
+    fa->last = now;
+    fa->seen++;
+    return true;
+}
+
+// one full cycle on a fresh map. false if the map lost or invented keys.
+template<bool Timed>
+static bool run_round(vector<Item>& items, const vector<size_t>& order, Result* res){
+    size_t n = items.size();
+    size_t found = 0;
+    HashMap hmap;
+    {
+        Phase ph(res[OP_INSERT], n);
+        for(size_t i = 0; i < n; i++){
+            step<Timed>(res[OP_INSERT], [&]{ hmap_insert(&hmap, &items[i].node); });
+        }
+    }
+    {
+        Phase ph(res[OP_HIT], n);
+        for(size_t i : order){
+            Item probe;
+            probe.key = items[i].key;
+            probe.node.hCode = items[i].node.hCode;
+            step<Timed>(res[OP_HIT], [&]{
+                found += hmap_lookup(&hmap, &probe.node, item_eq) != nullptr;
+            });
+        }
+    }
+    {
+        Phase ph(res[OP_MISS], n);
+        for(size_t i : order){
+            Item probe;
+            probe.key = items[i].key + 1;
+            probe.node.hCode = mix(probe.key);
+            step<Timed>(res[OP_MISS], [&]{
+                found += hmap_lookup(&hmap, &probe.node, item_eq) != nullptr;
+            });
+        }
+    }
+    ForEachArg fa;
+    {
+        Phase ph(res[OP_FOR_EACH], n);
+        if(Timed){
+            fa.lat = &res[OP_FOR_EACH].lat;
+            fa.last = now_ns();
+            hmap_for_each_key(&hmap, cb_gap, &fa);
+        }else{
+            hmap_for_each_key(&hmap, cb_count, &fa);
+        }
+    }
+    {
+        Phase ph(res[OP_DELETE], n);
+        for(size_t i : order){
+            step<Timed>(res[OP_DELETE], [&]{
+                found += hmap_delete(&hmap, &items[i].node, item_eq) != nullptr;
+            });
+        }
+    }
+    bool ok = found == 2 * n && fa.seen == n && hmap_size(&hmap) == 0;
+    hmap_clear(&hmap);
+    return ok;
+}
+
+// the cost of the clock reads, included in every latency below.
+static uint64_t timer_overhead(){
+    Histogram h;
+    for(int i = 0; i < 100000; i++){
+        uint64_t t0 = now_ns();
+        h.record(now_ns() - t0);
+    }
+    return h.percentile(50);
+}
+
+// "1000", "10K", "50M".
+static size_t parse_size(const char* s){
+    char* end = nullptr;
+    double v = strtod(s, &end);
+    if(*end == 'k' || *end == 'K'){
+        v *= 1e3;
+    }else if(*end == 'm' || *end == 'M'){
+        v *= 1e6;
+    }
+    return (size_t)v;
+}
+
+static bool bench_size(size_t n){
+    // the small sizes are repeated until there are enough operations to time.
+    const size_t k_min_ops = 4000000;
+    size_t rounds = max<size_t>(1, k_min_ops / max<size_t>(n, 1));
+
+    // even keys are present, odd keys miss. lookups and deletes go in a
+    // shuffled order so they do not follow insertion order.
+    vector<Item> items(n);
+    for(size_t i = 0; i < n; i++){
+        items[i].key = i * 2;
+        items[i].node.hCode = mix(items[i].key);
+    }
+    vector<size_t> order(n);
+    iota(order.begin(), order.end(), 0);
+    shuffle(order.begin(), order.end(), mt19937_64(42));
+
+    Result bulk[OP_COUNT], timed[OP_COUNT];
+    for(size_t r = 0; r < rounds; r++){
+        if(!run_round<false>(items, order, bulk) || !run_round<true>(items, order, timed)){
+            return false;
+        }
+    }
+
+    printf("%s, %zu keys, %zu round%s\n", k_backend, n, rounds, rounds > 1 ? "s" : "");
+    printf("  %-12s %8s %10s %8s %8s %8s %8s %10s %8s\n", "op", "ns/op", "allocs/op",
+        "p50", "p99", "p99.9", "p99.99", "max", ">10us");
+    for(int op = 0; op < OP_COUNT; op++){
+        const Result& b = bulk[op];
+        const Histogram& h = timed[op].lat;
+        printf("  %-12s %8.1f %10.4f %8llu %8llu %8llu %8llu %10llu %8llu\n", k_op_names[op],
+            (double)b.ns / b.ops, (double)b.allocs / b.ops,
+            (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(99),
+            (unsigned long long)h.percentile(99.9), (unsigned long long)h.percentile(99.99),
+            (unsigned long long)h.max, (unsigned long long)h.count_above(10000));
+    }
+    return true;
+}
+
+int main(int argc, char** argv){
+    vector<size_t> sizes;
+    for(int i = 1; i < argc; i++){
+        sizes.push_back(parse_size(argv[i]));
+    }
+    if(sizes.empty()){
+        sizes.push_back(1000000);
+    }
+    printf("%s: latencies in ns, timer overhead ~%llu ns included\n",
+        k_backend, (unsigned long long)timer_overhead());
+    for(size_t n : sizes){
+        if(!bench_size(n)){
+            fprintf(stderr, "bench_hashmap: inconsistent results\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// an immutable, refcounted byte string. stored values live in blobs so a
+// pending response can point at the value instead of copying it; the value
+// stays alive until the last write referencing it is done, even if the key
+// is overwritten or deleted in the meantime (possibly by another thread).
+struct Blob {
+    std::atomic<uint32_t> refs;
+    uint32_t len;
+    char data[];
+};
+
+inline Blob *blob_new(const char *data, size_t len) {
+    Blob *blob = (Blob *)malloc(sizeof(Blob) + len);
+    new (&blob->refs) std::atomic<uint32_t>(1);
+    blob->len = (uint32_t)len;
+    memcpy(blob->data, data, len);
+    return blob;
+}
+
+inline void blob_ref(Blob *blob) {
+    blob->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void blob_unref(Blob *blob) {
+    if (blob->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        free(blob);
+    }
+}
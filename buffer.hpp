@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// a byte queue with begin/end offsets into one allocation.
+//
+// [buffer_begin ... data_begin ... data_end ... buffer_end]
+//        consumed         data          free space
+//
+// consuming only moves data_begin, so it is O(1). the data is slid back to
+// the front lazily, when the tail runs out of room and at least half of the
+// allocation is free, so the memmove is amortized over the consumed bytes.
+struct Buffer {
+    uint8_t *buffer_begin = nullptr;
+    uint8_t *buffer_end = nullptr;
+    uint8_t *data_begin = nullptr;
+    uint8_t *data_end = nullptr;
+
+    Buffer() = default;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer() { free(buffer_begin); }
+};
+
+inline uint8_t *buf_data(const Buffer *buf) { return buf->data_begin; }
+inline size_t buf_len(const Buffer *buf) { return buf->data_end - buf->data_begin; }
+inline bool buf_empty(const Buffer *buf) { return buf->data_end == buf->data_begin; }
+inline size_t buf_cap(const Buffer *buf) { return buf->buffer_end - buf->buffer_begin; }
+
+// free space after the data, valid until the next reserve.
+inline uint8_t *buf_tail(const Buffer *buf) { return buf->data_end; }
+inline size_t buf_tail_room(const Buffer *buf) { return buf->buffer_end - buf->data_end; }
+
+// make room for at least n more bytes after the data.
+inline void buf_reserve(Buffer *buf, size_t n) {
+    if (buf_tail_room(buf) >= n) {
+        return;
+    }
+    size_t len = buf_len(buf);
+    size_t cap = buf_cap(buf);
+    if (cap - len >= n && len <= cap / 2) {
+        // enough room overall, slide the data to the front.
+        memmove(buf->buffer_begin, buf->data_begin, len);
+    } else {
+        size_t new_cap = cap ? cap * 2 : 4096;
+        while (new_cap < len + n) {
+            new_cap *= 2;
+        }
+        uint8_t *mem = (uint8_t *)malloc(new_cap);
+        if (len) {
+            memcpy(mem, buf->data_begin, len);
+        }
+        free(buf->buffer_begin);
+        buf->buffer_begin = mem;
+        buf->buffer_end = mem + new_cap;
+    }
+    buf->data_begin = buf->buffer_begin;
+    buf->data_end = buf->buffer_begin + len;
+}
+
+// mark n bytes written into the tail (e.g. by read()) as data.
+inline void buf_commit(Buffer *buf, size_t n) {
+    buf->data_end += n;
+}
+
+inline void buf_append(Buffer *buf, const uint8_t *data, size_t n) {
+    buf_reserve(buf, n);
+    memcpy(buf->data_end, data, n);
+    buf->data_end += n;
+}
+
+inline void buf_consume(Buffer *buf, size_t n) {
+    buf->data_begin += n;
+    if (buf->data_begin == buf->data_end) {
+        // empty, start over from the front for free.
+        buf->data_begin = buf->data_end = buf->buffer_begin;
+    }
+}
+
+// drop everything after the first n bytes of data.
+inline void buf_truncate(Buffer *buf, size_t n) {
+    buf->data_end = buf->data_begin + n;
+}
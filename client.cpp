@@ -6,6 +6,7 @@
 #include <iostream>
 #include <cstring>
 #include <cstdint>
+#include "proto.hpp"
 
 using namespace std;
 
@@ -21,35 +22,16 @@ enum {
 enum {
     ERR_UNKNOWN = 1,
     ERR_TOO_BIG = 2,
+    ERR_BAD_TYP = 3,
+    ERR_BAD_ARG = 4,
+    ERR_READONLY = 5,
+    ERR_OOM = 6,
 };
 
-static void write_u32(vector<uint8_t>& buf, uint32_t x) {
-    uint8_t* p = (uint8_t*)&x;
-    buf.insert(buf.end(), p, p + 4);
-}
-
 static void write_u8(vector<uint8_t>& buf, uint8_t x) {
     buf.push_back(x);
 }
 
-static void write_str(vector<uint8_t>& buf, const string& s) {
-    write_u32(buf, s.size());
-    buf.insert(buf.end(), s.begin(), s.end());
-}
-
-static vector<uint8_t> make_request(const vector<string>& cmd) {
-    vector<uint8_t> body;
-    write_u32(body, cmd.size());
-    for (auto& s : cmd) {
-        write_str(body, s);
-    }
-
-    vector<uint8_t> msg;
-    write_u32(msg, body.size());
-    msg.insert(msg.end(), body.begin(), body.end());
-    return msg;
-}
-
 static bool read_exact(int fd, void* buf, size_t n) {
     size_t off = 0;
     while (off < n) {
@@ -0,0 +1,54 @@
+#include <cstring>
+#include "crc32c.hpp"
+
+struct Crc32cTable {
+    uint32_t t[256] = {};
+
+    constexpr Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1))); // reflected polynomial
+            }
+            t[i] = c;
+        }
+    }
+};
+
+static constexpr Crc32cTable k_crc_table;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = k_crc_table.t[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; len > 0; p++, len--) {
+        c32 = __builtin_ia32_crc32qi(c32, *p);
+    }
+    return c32;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    crc = hw ? crc32c_hw(crc, p, len) : crc32c_sw(crc, p, len);
+#else
+    crc = crc32c_sw(crc, p, len);
+#endif
+    return ~crc;
+}
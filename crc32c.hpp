@@ -0,0 +1,8 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli), the checksum of the snapshot file. uses the SSE4.2
+// crc32 instruction when the CPU has it. start with crc = 0 and feed the
+// previous result back in to checksum data in pieces.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
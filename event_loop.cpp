@@ -0,0 +1,127 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "event_loop.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+static uint32_t ev_to_epoll(uint32_t events) {
+    uint32_t out = 0;
+    if (events & EV_READ) out |= EPOLLIN;
+    if (events & EV_WRITE) out |= EPOLLOUT;
+    return out; // EPOLLERR and EPOLLHUP are always reported.
+}
+
+static short ev_to_poll(uint32_t events) {
+    short out = POLLERR;
+    if (events & EV_READ) out |= POLLIN;
+    if (events & EV_WRITE) out |= POLLOUT;
+    return out;
+}
+
+void ev_init(EventLoop *loop, int backend) {
+    loop->backend = backend;
+    if (backend == EV_BACKEND_EPOLL) {
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) {
+            msg("epoll_create1() failed, falling back to poll");
+            loop->backend = EV_BACKEND_POLL;
+        }
+    }
+}
+
+void ev_add(EventLoop *loop, int fd, uint32_t events) {
+    if (loop->backend == EV_BACKEND_EPOLL) {
+        struct epoll_event ev = {};
+        ev.events = ev_to_epoll(events);
+        ev.data.fd = fd;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            die("epoll_ctl(ADD) failed");
+        }
+        return;
+    }
+    if (fd >= (int)loop->fd2idx.size()) {
+        loop->fd2idx.resize(fd + 1, -1);
+    }
+    assert(loop->fd2idx[fd] < 0);
+    loop->fd2idx[fd] = (int)loop->pfds.size();
+    loop->pfds.push_back({fd, ev_to_poll(events), 0});
+}
+
+void ev_mod(EventLoop *loop, int fd, uint32_t events) {
+    if (loop->backend == EV_BACKEND_EPOLL) {
+        struct epoll_event ev = {};
+        ev.events = ev_to_epoll(events);
+        ev.data.fd = fd;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+            die("epoll_ctl(MOD) failed");
+        }
+        return;
+    }
+    assert(fd < (int)loop->fd2idx.size() && loop->fd2idx[fd] >= 0);
+    loop->pfds[loop->fd2idx[fd]].events = ev_to_poll(events);
+}
+
+void ev_del(EventLoop *loop, int fd) {
+    if (loop->backend == EV_BACKEND_EPOLL) {
+        // must be called before close(), the kernel drops closed fds anyway.
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, nullptr);
+        return;
+    }
+    // swap with the last slot so removal stays O(1).
+    int idx = loop->fd2idx[fd];
+    assert(idx >= 0);
+    struct pollfd last = loop->pfds.back();
+    loop->pfds[idx] = last;
+    loop->fd2idx[last.fd] = idx;
+    loop->pfds.pop_back();
+    loop->fd2idx[fd] = -1;
+}
+
+static int ev_wait_epoll(EventLoop *loop, vector<EvEvent> &out, int timeout_ms) {
+    struct epoll_event evs[256];
+    int rv = epoll_wait(loop->epfd, evs, 256, timeout_ms);
+    if (rv < 0) {
+        return -1;
+    }
+    for (int i = 0; i < rv; i++) {
+        uint32_t ready = 0;
+        if (evs[i].events & EPOLLIN) ready |= EV_READ;
+        if (evs[i].events & EPOLLOUT) ready |= EV_WRITE;
+        if (evs[i].events & (EPOLLERR | EPOLLHUP)) ready |= EV_ERR;
+        out.push_back({evs[i].data.fd, ready});
+    }
+    return rv;
+}
+
+static int ev_wait_poll(EventLoop *loop, vector<EvEvent> &out, int timeout_ms) {
+    int rv = poll(loop->pfds.data(), nfds_t(loop->pfds.size()), timeout_ms);
+    if (rv <= 0) {
+        return rv;
+    }
+    for (struct pollfd &pfd : loop->pfds) {
+        if (pfd.revents == 0) {
+            continue;
+        }
+        uint32_t ready = 0;
+        if (pfd.revents & POLLIN) ready |= EV_READ;
+        if (pfd.revents & POLLOUT) ready |= EV_WRITE;
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) ready |= EV_ERR;
+        out.push_back({pfd.fd, ready});
+        pfd.revents = 0;
+    }
+    return (int)out.size();
+}
+
+int ev_wait(EventLoop *loop, vector<EvEvent> &out, int timeout_ms) {
+    out.clear();
+    if (loop->backend == EV_BACKEND_EPOLL) {
+        return ev_wait_epoll(loop, out, timeout_ms);
+    }
+    return ev_wait_poll(loop, out, timeout_ms);
+}
+
+const char *ev_backend_name(EventLoop *loop) {
+    return loop->backend == EV_BACKEND_EPOLL ? "epoll" : "poll";
+}
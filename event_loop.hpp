@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <poll.h>
+
+// readiness events, independent of the backend.
+enum {
+    EV_READ = 1,
+    EV_WRITE = 2,
+    EV_ERR = 4, // error or hangup, always reported.
+};
+
+enum {
+    EV_BACKEND_EPOLL = 0,
+    EV_BACKEND_POLL = 1,
+};
+
+struct EvEvent {
+    int fd;
+    uint32_t events;
+};
+
+// a small readiness loop. fds are registered once and only touched again
+// when their interest changes. epoll reports only the ready fds; poll is kept
+// as a fallback and still scans everything, but no longer rebuilds its array.
+struct EventLoop {
+    int backend = EV_BACKEND_EPOLL;
+    int epfd = -1;
+
+    // poll backend only.
+    std::vector<struct pollfd> pfds;
+    std::vector<int> fd2idx; // fd -> index in pfds, -1 if not registered.
+};
+
+// falls back to poll if epoll is not available.
+void ev_init(EventLoop *loop, int backend);
+void ev_add(EventLoop *loop, int fd, uint32_t events);
+void ev_mod(EventLoop *loop, int fd, uint32_t events);
+void ev_del(EventLoop *loop, int fd);
+// returns the number of ready fds, or -1 with errno set.
+int ev_wait(EventLoop *loop, std::vector<EvEvent> &out, int timeout_ms);
+const char *ev_backend_name(EventLoop *loop);
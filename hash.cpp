@@ -0,0 +1,92 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "hash.hpp"
+
+// the mixing steps follow wyhash (final version 4, public domain).
+
+static const uint64_t k_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+};
+
+static uint64_t g_seed = 0;
+
+// 64x64 -> 128 bit multiply, folded.
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// 1 to 3 bytes, without branching on the exact length.
+static inline uint64_t read3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+void hash_seed_init() {
+    uint64_t seed = 0;
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        // no entropy source, still better than a fixed seed.
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed = (uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)getpid();
+    }
+    g_seed = mix(seed ^ k_secret[0], k_secret[1]);
+}
+
+uint64_t hash_bytes(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t seed = g_seed;
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            // two overlapping 4-byte reads from each end cover 4..16 bytes.
+            a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+            b = (read4(p + len - 4) << 32) | read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = read3(p, len);
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // three independent lanes of 16 bytes keep the multipliers busy.
+            uint64_t see1 = seed;
+            uint64_t see2 = seed;
+            do {
+                seed = mix(read8(p) ^ k_secret[1], read8(p + 8) ^ seed);
+                see1 = mix(read8(p + 16) ^ k_secret[2], read8(p + 24) ^ see1);
+                see2 = mix(read8(p + 32) ^ k_secret[3], read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(read8(p) ^ k_secret[1], read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+    a ^= k_secret[1];
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return mix(a ^ k_secret[0] ^ len, b ^ k_secret[1]);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit keyed hash for keys that come from clients. it reads 8-16 bytes
+// per step (a wyhash-style multiply-mix), and is keyed with a per-process
+// random seed, so collisions cannot be precomputed offline to flood one
+// bucket. all 64 bits are usable: the tables take the low bits for the
+// bucket, the swiss backend the top 7 bits for its tags.
+void hash_seed_init();
+uint64_t hash_bytes(const void *data, size_t len);
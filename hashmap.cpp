@@ -76,6 +76,24 @@ HashNode* hmap_lookup (HashMap* hmap , HashNode * key, bool (*eq)(HashNode* , Ha
     return from ? *from  : nullptr;
 }
 
+void hmap_prefetch(HashMap* hmap, uint64_t hCode){
+    // the bucket heads, in both tables while rehashing.
+    if(hmap->new_table.table){
+        __builtin_prefetch(&hmap->new_table.table[hCode & hmap->new_table.mask]);
+    }
+    if(hmap->old_table.table){
+        __builtin_prefetch(&hmap->old_table.table[hCode & hmap->old_table.mask]);
+    }
+}
+
+void hmap_prefetch_node(HashMap* hmap, uint64_t hCode){
+    if(hmap->new_table.table){
+        if(HashNode* head = hmap->new_table.table[hCode & hmap->new_table.mask]){
+            __builtin_prefetch(head);
+        }
+    }
+}
+
 const size_t k_max_load_factor = 8;
 
 void hmap_insert(HashMap* hmap , HashNode * node){
@@ -104,11 +122,64 @@ HashNode *hmap_delete ( HashMap*hmap, HashNode*key , bool(*eq)(HashNode* , HashN
     return nullptr;
 }
 
+void hmap_reserve(HashMap* hmap, size_t n){
+    if(hmap->new_table.table || hmap->old_table.table){
+        return; // only sizes an empty map.
+    }
+    size_t nbuckets = 4;
+    while(nbuckets * k_max_load_factor <= n){
+        nbuckets *= 2;
+    }
+    h_init(&hmap->new_table, nbuckets);
+}
+
+void hmap_clear(HashMap* hmap){
+    free(hmap->new_table.table);
+    free(hmap->old_table.table);
+    *hmap = HashMap{};
+}
+
 size_t hmap_size(HashMap* hmap){
 
     return hmap->new_table.size + hmap->old_table.size;
 }
 
+bool hmap_rehashing(HashMap* hmap){
+    return hmap->old_table.size > 0;
+}
+
+size_t hmap_mem(HashMap* hmap){
+    size_t nbuckets = 0;
+    if(hmap->new_table.table){
+        nbuckets += hmap->new_table.mask + 1;
+    }
+    if(hmap->old_table.table){
+        nbuckets += hmap->old_table.mask + 1;
+    }
+    return nbuckets * sizeof(HashNode*);
+}
+
+// whole chains from consecutive buckets, at most 16 buckets per node wanted.
+static size_t h_sample(HashTable* htab, size_t pos, HashNode** out, size_t n){
+    if(!htab->table || htab->size == 0){
+        return 0;
+    }
+    size_t got = 0;
+    size_t steps = min(n * 16, htab->mask + 1);
+    for(size_t i = 0; i < steps && got < n; i++){
+        for(HashNode* node = htab->table[(pos + i) & htab->mask]; node && got < n; node = node->next){
+            out[got++] = node;
+        }
+    }
+    return got;
+}
+
+size_t hmap_sample(HashMap* hmap, uint64_t seed, HashNode** out, size_t n){
+    // while rehashing, the old table only holds buckets past migrate_pos.
+    size_t got = h_sample(&hmap->old_table, seed, out, n / 2);
+    return got + h_sample(&hmap->new_table, seed, out + got, n - got);
+}
+
 static bool h_foreach(HashTable *htab,
                       bool (*f)(HashNode *, void *),
                       void *arg) {
@@ -133,3 +204,52 @@ void hmap_for_each_key(HashMap *hmap,
     if (!h_foreach(&hmap->new_table, f, arg)) return;
     h_foreach(&hmap->old_table, f, arg);
 }
+
+static bool h_scan_ready(HashTable* htab){
+    return htab->table != nullptr;
+}
+
+static void h_scan_bucket(HashTable* htab, size_t pos, void (*f)(HashNode*, void*), void* arg){
+    for(HashNode* node = htab->table[pos]; node; node = node->next){
+        f(node, arg);
+    }
+}
+
+// reverse-binary cursor, as in redis' dictScan(): the cursor's bits are
+// incremented from the top of the mask down, so the home buckets already
+// visited stay visited when the table doubles or halves. each step visits
+// one home bucket of the smaller table and every home bucket of the larger
+// table that it splits into, so a node that is in either table for the
+// whole scan is returned at least once, wherever the migration stands.
+static size_t rev_bits(size_t v){
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+static size_t scan_next(size_t v, size_t mask){
+    v |= ~mask;
+    return rev_bits(rev_bits(v) + 1);
+}
+
+size_t hmap_scan(HashMap* hmap, size_t cursor, void (*f)(HashNode*, void*), void* arg){
+    HashTable* t0 = &hmap->new_table;
+    HashTable* t1 = &hmap->old_table;
+    if(!h_scan_ready(t0)){
+        return 0; // empty map.
+    }
+    if(!h_scan_ready(t1)){
+        h_scan_bucket(t0, cursor & t0->mask, f, arg);
+        return scan_next(cursor, t0->mask);
+    }
+    if(t0->mask > t1->mask){
+        std::swap(t0, t1); // t0 is the smaller one.
+    }
+    h_scan_bucket(t0, cursor & t0->mask, f, arg);
+    do{
+        h_scan_bucket(t1, cursor & t1->mask, f, arg);
+        cursor = scan_next(cursor, t1->mask);
+    }while(cursor & (t0->mask ^ t1->mask));
+    return cursor;
+}
@@ -1,6 +1,25 @@
 #pragma once 
 #include<bits/stdc++.h>
 
+// two interchangeable backends, picked at build time (make HASHMAP=swiss):
+// the default chained table, and an open-addressing table probed a group
+// of control bytes at a time with SSE2 (hashmap_swiss.cpp).
+#ifdef LOOPDB_HMAP_SWISS
+
+struct HashNode{
+    uint64_t hCode = 0;
+};
+
+struct HashTable{
+    uint8_t* ctrl = nullptr;     // one tag byte per slot, 16 slots per group.
+    HashNode** slots = nullptr;
+    size_t mask = 0;             // number of groups - 1.
+    size_t size = 0;
+    size_t used = 0;             // size + tombstones, drives the resize.
+};
+
+#else
+
 struct HashNode{
     HashNode* next = nullptr;
     uint64_t hCode = 0;
@@ -12,6 +31,8 @@ struct HashTable{
     size_t size = 0;
 };
 
+#endif
+
 struct HashMap{
     // yes, not pointers just objects.
     HashTable new_table;
@@ -22,7 +43,27 @@ struct HashMap{
 
 HashNode* hmap_lookup (HashMap* hmap , HashNode * key, bool (*eq)(HashNode* , HashNode*));
 void hmap_insert(HashMap* hmap , HashNode * node);
+// only hints, for looking up a batch of keys: the cache misses of all keys
+// are waited for together instead of one after another. first the bucket
+// heads of every key, then (once those have arrived) the first node each
+// bucket leads to, then the lookups.
+void hmap_prefetch(HashMap* hmap, uint64_t hCode);
+void hmap_prefetch_node(HashMap* hmap, uint64_t hCode);
 HashNode *hmap_delete ( HashMap*hmap, HashNode*key , bool(*eq)(HashNode* , HashNode *));
+// sizes an empty map for `n` nodes, so inserting them never resizes.
+void hmap_reserve(HashMap* hmap, size_t n);
 void hmap_clear(HashMap* hmap);
 size_t hmap_size(HashMap *hmap);
-void hmap_for_each_key(HashMap* hmap, bool (*f)(HashNode* , void*), void* arg);
\ No newline at end of file
+// true while nodes are still moving to the new table, from `migrate_pos` on.
+bool hmap_rehashing(HashMap* hmap);
+// bytes allocated for the tables, not counting the nodes.
+size_t hmap_mem(HashMap* hmap);
+// up to `n` nodes from the buckets around a position picked by `seed`, for
+// approximate algorithms (eviction). nodes of the same bucket come together,
+// so this is not a uniform sample; fewer than `n` if the map is sparse.
+size_t hmap_sample(HashMap* hmap, uint64_t seed, HashNode** out, size_t n);
+void hmap_for_each_key(HashMap* hmap, bool (*f)(HashNode* , void*), void* arg);
+// one step of an incremental scan, start with cursor 0. calls `f` for the
+// nodes of one or more buckets and returns the next cursor, 0 when done.
+// nodes present for the whole scan are seen at least once, maybe twice.
+size_t hmap_scan(HashMap* hmap, size_t cursor, void (*f)(HashNode*, void*), void* arg);
@@ -0,0 +1,367 @@
+#include<bits/stdc++.h>
+#include"hashmap.hpp"
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
+using namespace std;
+
+// open addressing, swiss-table style. every slot has a control byte: the top
+// 7 bits of the hash for a used slot, or EMPTY / DELETED (high bit set). one
+// 16-byte group of control bytes is compared against the tag with a single
+// SSE2 instruction, so a lookup usually touches one control line and one
+// slot instead of chasing `next` pointers.
+
+const size_t k_group = 16;
+const uint8_t k_empty = 0x80;
+const uint8_t k_deleted = 0xFE;
+const size_t k_npos = SIZE_MAX;
+
+// the tag comes from the top bits, the group from the low bits, so the two
+// stay independent however large the table grows.
+static uint8_t h_tag(uint64_t hCode){
+    return hCode >> 57;
+}
+
+static size_t h_group(uint64_t hCode){
+    return hCode;
+}
+
+// bit i is set if ctrl[i] == b.
+static uint32_t group_match(const uint8_t* ctrl, uint8_t b){
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)b)));
+#else
+    uint32_t m = 0;
+    for(size_t i = 0; i < k_group; i++){
+        m |= (uint32_t)(ctrl[i] == b) << i;
+    }
+    return m;
+#endif
+}
+
+// empty or deleted: the only control bytes with the high bit set.
+static uint32_t group_match_free(const uint8_t* ctrl){
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    uint32_t m = 0;
+    for(size_t i = 0; i < k_group; i++){
+        m |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return m;
+#endif
+}
+
+static size_t h_capacity(HashTable* htab){
+    return htab->ctrl ? (htab->mask + 1) * k_group : 0;
+}
+
+// keep at least 1/8 of the slots empty so probes terminate quickly.
+static size_t h_max_used(HashTable* htab){
+    return h_capacity(htab) / 8 * 7;
+}
+
+static void h_init(HashTable* htab, size_t ngroups){
+    assert(ngroups > 0 && (ngroups & (ngroups-1)) == 0);
+    htab->ctrl = (uint8_t*) malloc(ngroups * k_group);
+    memset(htab->ctrl, k_empty, ngroups * k_group);
+    htab->slots = (HashNode**) calloc(ngroups * k_group, sizeof(HashNode*));
+    htab->mask = ngroups - 1;
+    htab->size = 0;
+    htab->used = 0;
+}
+
+static void h_free(HashTable* htab){
+    free(htab->ctrl);
+    free(htab->slots);
+    *htab = HashTable{};
+}
+
+// groups are probed triangularly, which visits every group once.
+static void h_insert(HashTable* htab, HashNode* node){
+    size_t g = h_group(node->hCode) & htab->mask;
+    for(size_t step = 1;; step++){
+        uint8_t* ctrl = htab->ctrl + g * k_group;
+        if(uint32_t m = group_match_free(ctrl)){
+            size_t pos = g * k_group + __builtin_ctz(m);
+            if(htab->ctrl[pos] == k_empty){
+                htab->used++;
+            }
+            htab->ctrl[pos] = h_tag(node->hCode);
+            htab->slots[pos] = node;
+            htab->size++;
+            return;
+        }
+        g = (g + step) & htab->mask;
+    }
+}
+
+static size_t h_lookup(HashTable* htab, HashNode* key, bool(*eq)(HashNode*, HashNode*)){
+    if(!htab->ctrl) return k_npos;
+
+    uint8_t tag = h_tag(key->hCode);
+    size_t g = h_group(key->hCode) & htab->mask;
+    for(size_t step = 1; step <= htab->mask + 1; step++){
+        const uint8_t* ctrl = htab->ctrl + g * k_group;
+        for(uint32_t m = group_match(ctrl, tag); m; m &= m - 1){
+            size_t pos = g * k_group + __builtin_ctz(m);
+            HashNode* curr = htab->slots[pos];
+            if(curr->hCode == key->hCode && eq(curr, key)){
+                return pos;
+            }
+        }
+        if(group_match(ctrl, k_empty)){
+            return k_npos; // the key would have been placed in this group.
+        }
+        g = (g + step) & htab->mask;
+    }
+    return k_npos;
+}
+
+static HashNode* h_detach(HashTable* htab, size_t pos){
+    HashNode* node = htab->slots[pos];
+    size_t g = pos / k_group;
+    // if the group still has an empty slot no probe ever went past it, so
+    // the slot can become empty again instead of a tombstone.
+    if(group_match(htab->ctrl + g * k_group, k_empty)){
+        htab->ctrl[pos] = k_empty;
+        htab->used--;
+    }else{
+        htab->ctrl[pos] = k_deleted;
+    }
+    htab->slots[pos] = nullptr;
+    htab->size--;
+    return node;
+}
+
+// slots visited per operation while a resize is in progress. the old table
+// is drained after capacity / k_rehashing_work operations, long before the
+// new (twice as large) table can fill up.
+const size_t k_rehashing_work = 128;
+
+static void hm_help_rehashing(HashMap* hmap){
+    size_t work_done = 0;
+    while(work_done < k_rehashing_work && hmap->old_table.size > 0){
+        size_t pos = hmap->migrate_pos++;
+        work_done++;
+        if(hmap->old_table.ctrl[pos] & 0x80){
+            continue; // empty or deleted.
+        }
+        h_insert(&hmap->new_table, h_detach(&hmap->old_table, pos));
+    }
+
+    if(hmap->old_table.size == 0 && hmap->old_table.ctrl){
+        h_free(&hmap->old_table);
+    }
+}
+
+static void hm_trigger_rehashing(HashMap* hmap){
+    assert(hmap->old_table.ctrl == nullptr); // older table has to be empty.
+    size_t ngroups = hmap->new_table.mask + 1;
+    // mostly tombstones: rebuild at the same size, otherwise grow.
+    if(hmap->new_table.size * 2 > h_max_used(&hmap->new_table)){
+        ngroups *= 2;
+    }
+    hmap->old_table = hmap->new_table;
+    h_init(&hmap->new_table, ngroups);
+    hmap->migrate_pos = 0;
+}
+
+HashNode* hmap_lookup(HashMap* hmap, HashNode* key, bool (*eq)(HashNode*, HashNode*)){
+    hm_help_rehashing(hmap);
+    size_t pos = h_lookup(&hmap->new_table, key, eq);
+    if(pos != k_npos){
+        return hmap->new_table.slots[pos];
+    }
+    pos = h_lookup(&hmap->old_table, key, eq);
+    return pos != k_npos ? hmap->old_table.slots[pos] : nullptr;
+}
+
+static void h_prefetch(HashTable* htab, uint64_t hCode){
+    if(!htab->ctrl){
+        return;
+    }
+    // the home group's control bytes and its 16 slots (two cache lines).
+    size_t g = h_group(hCode) & htab->mask;
+    __builtin_prefetch(htab->ctrl + g * k_group);
+    __builtin_prefetch(htab->slots + g * k_group);
+    __builtin_prefetch(htab->slots + g * k_group + k_group / 2);
+}
+
+void hmap_prefetch(HashMap* hmap, uint64_t hCode){
+    h_prefetch(&hmap->new_table, hCode);
+    h_prefetch(&hmap->old_table, hCode);
+}
+
+void hmap_prefetch_node(HashMap* hmap, uint64_t hCode){
+    HashTable* htab = &hmap->new_table;
+    if(!htab->ctrl){
+        return;
+    }
+    // the first slot in the home group with a matching tag, usually the key.
+    size_t g = h_group(hCode) & htab->mask;
+    if(uint32_t m = group_match(htab->ctrl + g * k_group, h_tag(hCode))){
+        __builtin_prefetch(htab->slots[g * k_group + __builtin_ctz(m)]);
+    }
+}
+
+void hmap_insert(HashMap* hmap, HashNode* node){
+    if(!hmap->new_table.ctrl){
+        h_init(&hmap->new_table, 1);
+    }
+    if(hmap->new_table.used + 1 > h_max_used(&hmap->new_table)){
+        // unlike chaining, a full table cannot take more. finish a pending
+        // migration first (rare, see k_rehashing_work), then resize.
+        while(hmap->old_table.ctrl){
+            hm_help_rehashing(hmap);
+        }
+        hm_trigger_rehashing(hmap);
+    }
+    h_insert(&hmap->new_table, node);
+    hm_help_rehashing(hmap); // migrate some nodes.
+}
+
+HashNode* hmap_delete(HashMap* hmap, HashNode* key, bool(*eq)(HashNode*, HashNode*)){
+    hm_help_rehashing(hmap);
+    size_t pos = h_lookup(&hmap->new_table, key, eq);
+    if(pos != k_npos){
+        return h_detach(&hmap->new_table, pos);
+    }
+    pos = h_lookup(&hmap->old_table, key, eq);
+    if(pos != k_npos){
+        return h_detach(&hmap->old_table, pos);
+    }
+    return nullptr;
+}
+
+void hmap_reserve(HashMap* hmap, size_t n){
+    if(hmap->new_table.ctrl || hmap->old_table.ctrl){
+        return; // only sizes an empty map.
+    }
+    size_t ngroups = 1;
+    while(ngroups * k_group / 8 * 7 < n){
+        ngroups *= 2;
+    }
+    h_init(&hmap->new_table, ngroups);
+}
+
+void hmap_clear(HashMap* hmap){
+    h_free(&hmap->new_table);
+    h_free(&hmap->old_table);
+    hmap->migrate_pos = 0;
+}
+
+size_t hmap_size(HashMap* hmap){
+    return hmap->new_table.size + hmap->old_table.size;
+}
+
+bool hmap_rehashing(HashMap* hmap){
+    return hmap->old_table.size > 0;
+}
+
+size_t hmap_mem(HashMap* hmap){
+    size_t nslots = h_capacity(&hmap->new_table) + h_capacity(&hmap->old_table);
+    return nslots * (1 + sizeof(HashNode*));
+}
+
+// full slots from consecutive groups, at most 16 slots per node wanted.
+static size_t h_sample(HashTable* htab, size_t pos, HashNode** out, size_t n){
+    if(htab->size == 0){
+        return 0;
+    }
+    size_t cap = h_capacity(htab);
+    size_t steps = std::min(n * 16, cap);
+    size_t got = 0;
+    for(size_t i = 0; i < steps && got < n; i++){
+        size_t slot = (pos + i) & (cap - 1);
+        if(!(htab->ctrl[slot] & 0x80)){
+            out[got++] = htab->slots[slot];
+        }
+    }
+    return got;
+}
+
+size_t hmap_sample(HashMap* hmap, uint64_t seed, HashNode** out, size_t n){
+    size_t got = h_sample(&hmap->old_table, seed, out, n / 2);
+    return got + h_sample(&hmap->new_table, seed, out + got, n - got);
+}
+
+static bool h_foreach(HashTable* htab, bool (*f)(HashNode*, void*), void* arg){
+    size_t cap = h_capacity(htab);
+    for(size_t i = 0; i < cap; i++){
+        if(!(htab->ctrl[i] & 0x80) && !f(htab->slots[i], arg)){
+            return false; // early stop
+        }
+    }
+    return true;
+}
+
+void hmap_for_each_key(HashMap* hmap, bool (*f)(HashNode*, void*), void* arg){
+    // iterate new table first, then old table (during rehash)
+    if(!h_foreach(&hmap->new_table, f, arg)) return;
+    h_foreach(&hmap->old_table, f, arg);
+}
+
+static bool h_scan_ready(HashTable* htab){
+    return htab->ctrl != nullptr;
+}
+
+// the nodes whose home group is `home`. they sit along its probe sequence,
+// no further than the first group with an empty slot (see h_lookup), next
+// to nodes from other home groups, which are skipped.
+static void h_scan_bucket(HashTable* htab, size_t home, void (*f)(HashNode*, void*), void* arg){
+    size_t g = home;
+    for(size_t step = 1; step <= htab->mask + 1; step++){
+        const uint8_t* ctrl = htab->ctrl + g * k_group;
+        for(uint32_t m = ~group_match_free(ctrl) & 0xFFFF; m; m &= m - 1){
+            HashNode* node = htab->slots[g * k_group + __builtin_ctz(m)];
+            if((h_group(node->hCode) & htab->mask) == home){
+                f(node, arg);
+            }
+        }
+        if(group_match(ctrl, k_empty)){
+            return;
+        }
+        g = (g + step) & htab->mask;
+    }
+}
+
+// reverse-binary cursor, as in redis' dictScan(): the cursor's bits are
+// incremented from the top of the mask down, so the home buckets already
+// visited stay visited when the table doubles or halves. each step visits
+// one home bucket of the smaller table and every home bucket of the larger
+// table that it splits into, so a node that is in either table for the
+// whole scan is returned at least once, wherever the migration stands.
+static size_t rev_bits(size_t v){
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+static size_t scan_next(size_t v, size_t mask){
+    v |= ~mask;
+    return rev_bits(rev_bits(v) + 1);
+}
+
+size_t hmap_scan(HashMap* hmap, size_t cursor, void (*f)(HashNode*, void*), void* arg){
+    HashTable* t0 = &hmap->new_table;
+    HashTable* t1 = &hmap->old_table;
+    if(!h_scan_ready(t0)){
+        return 0; // empty map.
+    }
+    if(!h_scan_ready(t1)){
+        h_scan_bucket(t0, cursor & t0->mask, f, arg);
+        return scan_next(cursor, t0->mask);
+    }
+    if(t0->mask > t1->mask){
+        std::swap(t0, t1); // t0 is the smaller one.
+    }
+    h_scan_bucket(t0, cursor & t0->mask, f, arg);
+    do{
+        h_scan_bucket(t1, cursor & t1->mask, f, arg);
+        cursor = scan_next(cursor, t1->mask);
+    }while(cursor & (t0->mask ^ t1->mask));
+    return cursor;
+}
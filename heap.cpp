@@ -0,0 +1,67 @@
+#include"heap.hpp"
+
+static size_t heap_parent(size_t i){ return (i + 1) / 2 - 1; }
+static size_t heap_left(size_t i){ return i * 2 + 1; }
+static size_t heap_right(size_t i){ return i * 2 + 2; }
+
+static void heap_up(HeapItem* a, size_t pos){
+    HeapItem t = a[pos];
+    while(pos > 0 && a[heap_parent(pos)].val > t.val){
+        a[pos] = a[heap_parent(pos)];
+        *a[pos].ref = (uint32_t)pos;
+        pos = heap_parent(pos);
+    }
+    a[pos] = t;
+    *a[pos].ref = (uint32_t)pos;
+}
+
+static void heap_down(HeapItem* a, size_t pos, size_t len){
+    HeapItem t = a[pos];
+    while(true){
+        size_t l = heap_left(pos), r = heap_right(pos);
+        size_t min_pos = pos;
+        uint64_t min_val = t.val;
+        if(l < len && a[l].val < min_val){
+            min_pos = l;
+            min_val = a[l].val;
+        }
+        if(r < len && a[r].val < min_val){
+            min_pos = r;
+        }
+        if(min_pos == pos){
+            break;
+        }
+        a[pos] = a[min_pos];
+        *a[pos].ref = (uint32_t)pos;
+        pos = min_pos;
+    }
+    a[pos] = t;
+    *a[pos].ref = (uint32_t)pos;
+}
+
+static void heap_fix(std::vector<HeapItem>& heap, size_t pos){
+    if(pos > 0 && heap[heap_parent(pos)].val > heap[pos].val){
+        heap_up(heap.data(), pos);
+    }else{
+        heap_down(heap.data(), pos, heap.size());
+    }
+}
+
+void heap_push(std::vector<HeapItem>& heap, HeapItem item){
+    heap.push_back(item);
+    heap_up(heap.data(), heap.size() - 1);
+}
+
+void heap_set(std::vector<HeapItem>& heap, size_t pos, uint64_t val){
+    heap[pos].val = val;
+    heap_fix(heap, pos);
+}
+
+void heap_remove(std::vector<HeapItem>& heap, size_t pos){
+    *heap[pos].ref = k_heap_none;
+    heap[pos] = heap.back(); // fill the hole with the last item.
+    heap.pop_back();
+    if(pos < heap.size()){
+        heap_fix(heap, pos);
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include<cstddef>
+#include<cstdint>
+#include<vector>
+
+// binary min-heap of deadlines. every item points back at the index field
+// of its owner, which the heap keeps up to date as items move, so an owner
+// can change or drop its deadline in O(log n).
+struct HeapItem{
+    uint64_t val = 0;
+    uint32_t* ref = nullptr; // owner's copy of this item's position.
+};
+
+const uint32_t k_heap_none = UINT32_MAX; // not in the heap.
+
+void heap_push(std::vector<HeapItem>& heap, HeapItem item);
+void heap_set(std::vector<HeapItem>& heap, size_t pos, uint64_t val);
+void heap_remove(std::vector<HeapItem>& heap, size_t pos);
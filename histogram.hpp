@@ -0,0 +1,85 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// log-linear histogram in the HDR style: values below 2^SubBits are exact,
+// above that each power of two is split into 2^(SubBits - 1) buckets, so
+// every recorded value is within 1/2^(SubBits - 1) of its bucket.
+template <int SubBits>
+struct LogHistogram {
+    static constexpr int k_sub_bits = SubBits;
+    static constexpr uint64_t k_half = 1ull << (k_sub_bits - 1);
+    static constexpr size_t k_buckets = (64 - k_sub_bits + 2) * k_half;
+
+    std::vector<uint64_t> counts = std::vector<uint64_t>(k_buckets);
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    static size_t index(uint64_t v) {
+        if (v < 2 * k_half) {
+            return v;
+        }
+        int shift = 64 - __builtin_clzll(v) - k_sub_bits;
+        return (shift + 1) * k_half + (v >> shift) - k_half;
+    }
+
+    // the highest value that maps to bucket `i`.
+    static uint64_t upper(size_t i) {
+        if (i < 2 * k_half) {
+            return i;
+        }
+        uint64_t shift = i / k_half - 1;
+        uint64_t sub = i % k_half + k_half;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t v) {
+        counts[index(v)]++;
+        total++;
+        if (v > max) {
+            max = v;
+        }
+    }
+
+    void merge(const LogHistogram& other) {
+        for (size_t i = 0; i < k_buckets; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        if (other.max > max) {
+            max = other.max;
+        }
+    }
+
+    // values recorded above `v`, to within one bucket.
+    uint64_t count_above(uint64_t v) const {
+        uint64_t n = 0;
+        for (size_t i = index(v) + 1; i < k_buckets; i++) {
+            n += counts[i];
+        }
+        return n;
+    }
+
+    uint64_t percentile(double p) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)std::ceil(p / 100 * total);
+        if (rank == 0) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < k_buckets; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return upper(i) < max ? upper(i) : max;
+            }
+        }
+        return max;
+    }
+};
+
+// 1/128 precision, for the benchmarks.
+using Histogram = LogHistogram<8>;
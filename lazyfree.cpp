@@ -0,0 +1,71 @@
+#include <atomic>
+#include <thread>
+#include <semaphore.h>
+#include "lazyfree.hpp"
+
+// a multi-producer lock-free stack: workers push with a CAS on the head,
+// the single consumer takes the whole list with one exchange. the order in
+// which values are freed does not matter.
+struct LazyItem {
+    LazyItem *next = nullptr;
+    Garbage dead;
+};
+
+static std::atomic<LazyItem *> g_lazy_head{nullptr};
+static std::atomic<size_t> g_lazy_pending{0};
+static sem_t g_lazy_sem; // posted when the stack goes from empty to non-empty.
+
+void garbage_free(Garbage &dead) {
+    if (dead.blob) {
+        blob_unref(dead.blob);
+    }
+    if (dead.zset) {
+        zset_clear(dead.zset);
+        delete dead.zset;
+    }
+    dead = Garbage{};
+}
+
+bool garbage_is_big(const Garbage &dead) {
+    return (dead.blob && dead.blob->len >= k_lazyfree_min_bytes)
+        || (dead.zset && zset_size(dead.zset) >= k_lazyfree_min_members);
+}
+
+static void lazyfree_run() {
+    while (true) {
+        while (sem_wait(&g_lazy_sem) < 0) {
+            // EINTR
+        }
+        LazyItem *item = g_lazy_head.exchange(nullptr, std::memory_order_acquire);
+        while (item) {
+            LazyItem *next = item->next;
+            garbage_free(item->dead);
+            delete item;
+            g_lazy_pending.fetch_sub(1, std::memory_order_relaxed);
+            item = next;
+        }
+    }
+}
+
+void lazyfree_start() {
+    sem_init(&g_lazy_sem, 0, 0);
+    std::thread(lazyfree_run).detach();
+}
+
+void lazyfree_push(const Garbage &dead) {
+    LazyItem *item = new LazyItem();
+    item->dead = dead;
+    g_lazy_pending.fetch_add(1, std::memory_order_relaxed);
+    LazyItem *head = g_lazy_head.load(std::memory_order_relaxed);
+    do {
+        item->next = head;
+    } while (!g_lazy_head.compare_exchange_weak(head, item,
+                 std::memory_order_release, std::memory_order_relaxed));
+    if (!head) {
+        sem_post(&g_lazy_sem); // the consumer may be asleep.
+    }
+}
+
+size_t lazyfree_pending() {
+    return g_lazy_pending.load(std::memory_order_relaxed);
+}
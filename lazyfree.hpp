@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+#include "blob.hpp"
+#include "zset.hpp"
+
+// values unlinked from the keyspace, waiting to be freed.
+struct Garbage {
+    Blob *blob = nullptr;
+    ZSet *zset = nullptr;
+};
+
+// values at least this large are freed by the background thread: releasing
+// a multi-megabyte blob (munmap) or walking a big sorted set would stall
+// every client of the event loop.
+const size_t k_lazyfree_min_bytes = 64 * 1024;
+const size_t k_lazyfree_min_members = 64;
+
+void garbage_free(Garbage &dead);
+bool garbage_is_big(const Garbage &dead);
+
+// starts the reclamation thread, call once before lazyfree_push().
+void lazyfree_start();
+// lock-free, from any thread. the thread frees the values eventually.
+void lazyfree_push(const Garbage &dead);
+// values queued and not freed yet.
+size_t lazyfree_pending();
@@ -0,0 +1,33 @@
+#pragma once
+
+// intrusive circular doubly-linked list. a node that is not on a list
+// points at itself, so detaching it again is harmless.
+struct DList {
+    DList *prev = this;
+    DList *next = this;
+};
+
+inline void dlist_init(DList *node) {
+    node->prev = node->next = node;
+}
+
+inline bool dlist_empty(const DList *node) {
+    return node->next == node;
+}
+
+inline void dlist_detach(DList *node) {
+    DList *prev = node->prev;
+    DList *next = node->next;
+    prev->next = next;
+    next->prev = prev;
+    dlist_init(node);
+}
+
+// `rookie` goes in front of `target`; before the list head means the tail.
+inline void dlist_insert_before(DList *target, DList *rookie) {
+    DList *prev = target->prev;
+    prev->next = rookie;
+    rookie->prev = prev;
+    rookie->next = target;
+    target->prev = rookie;
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <sys/uio.h>
+#include "blob.hpp"
+#include "buffer.hpp"
+
+// pending output as a list of segments: runs of small inline bytes (headers,
+// short values) kept in `bytes`, interleaved with references to blobs. it
+// is flushed with writev()/sendmsg(), so large values go from the keyspace
+// to the socket without an intermediate copy.
+struct OutSeg {
+    Blob *blob = nullptr; // nullptr: the next `len` bytes of OutBuf::bytes.
+    size_t off = 0;       // bytes of this segment already written.
+    size_t len = 0;
+};
+
+struct OutBuf {
+    Buffer bytes;
+    std::deque<OutSeg> segs;
+    size_t total = 0; // pending bytes across all segments.
+
+    OutBuf() = default;
+    OutBuf(const OutBuf &) = delete;
+    OutBuf &operator=(const OutBuf &) = delete;
+    ~OutBuf() {
+        for (OutSeg &seg : segs) {
+            if (seg.blob) blob_unref(seg.blob);
+        }
+    }
+};
+
+// blobs shorter than this are copied, an iovec costs more than the memcpy.
+const size_t k_out_ref_min = 4 * 1024;
+
+inline bool out_empty(const OutBuf *out) { return out->total == 0; }
+
+inline void out_append(OutBuf *out, const uint8_t *data, size_t len) {
+    buf_append(&out->bytes, data, len);
+    if (out->segs.empty() || out->segs.back().blob) {
+        out->segs.push_back(OutSeg{});
+    }
+    out->segs.back().len += len;
+    out->total += len;
+}
+
+// takes a new reference on the blob.
+inline void out_append_blob(OutBuf *out, Blob *blob) {
+    if (blob->len < k_out_ref_min) {
+        return out_append(out, (const uint8_t *)blob->data, blob->len);
+    }
+    blob_ref(blob);
+    OutSeg seg;
+    seg.blob = blob;
+    seg.len = blob->len;
+    out->segs.push_back(seg);
+    out->total += blob->len;
+}
+
+// drop everything after `total` pending bytes, of which `inline_len` inline.
+// only valid while nothing behind that point has been written yet.
+inline void out_truncate(OutBuf *out, size_t total, size_t inline_len) {
+    buf_truncate(&out->bytes, inline_len);
+    while (out->total > total) {
+        OutSeg &seg = out->segs.back();
+        size_t excess = out->total - total;
+        size_t pending = seg.len - seg.off;
+        if (pending > excess) {
+            seg.len -= excess;
+            out->total -= excess;
+            break;
+        }
+        if (seg.blob) {
+            blob_unref(seg.blob);
+        }
+        out->total -= pending;
+        out->segs.pop_back();
+    }
+}
+
+// fills up to `max` iovecs from the front, returns how many were used.
+// stops in front of a blob with at least `split` pending bytes unless it is
+// the first segment, so such a blob can be sent on its own.
+inline size_t out_iovecs(const OutBuf *out, struct iovec *iov, size_t max,
+                         size_t split = SIZE_MAX) {
+    size_t n = 0;
+    const uint8_t *inl = buf_data(&out->bytes);
+    for (const OutSeg &seg : out->segs) {
+        if (n == max) {
+            break;
+        }
+        size_t pending = seg.len - seg.off;
+        if (seg.blob && pending >= split && n > 0) {
+            break;
+        }
+        if (seg.blob) {
+            iov[n++] = {seg.blob->data + seg.off, pending};
+        } else if (n > 0 && (uint8_t *)iov[n - 1].iov_base + iov[n - 1].iov_len == inl) {
+            iov[n - 1].iov_len += pending; // contiguous with the previous run.
+            inl += pending;
+        } else {
+            iov[n++] = {(void *)inl, pending};
+            inl += pending;
+        }
+    }
+    return n;
+}
+
+// n bytes from the front reached the socket.
+inline void out_consume(OutBuf *out, size_t n) {
+    out->total -= n;
+    while (n > 0) {
+        OutSeg &seg = out->segs.front();
+        size_t take = seg.len - seg.off;
+        if (take > n) {
+            take = n;
+        }
+        if (!seg.blob) {
+            buf_consume(&out->bytes, take);
+        }
+        seg.off += take;
+        n -= take;
+        if (seg.off == seg.len) {
+            if (seg.blob) {
+                blob_unref(seg.blob);
+            }
+            out->segs.pop_front();
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// request framing shared by the client and the benchmark:
+// u32 total length, u32 argument count, then u32 length + bytes per argument.
+
+inline void write_u32(std::vector<uint8_t>& buf, uint32_t x) {
+    uint8_t* p = (uint8_t*)&x;
+    buf.insert(buf.end(), p, p + 4);
+}
+
+inline void write_str(std::vector<uint8_t>& buf, std::string_view s) {
+    write_u32(buf, s.size());
+    buf.insert(buf.end(), s.begin(), s.end());
+}
+
+// appends one framed request to `out`, so pipelined requests can share a
+// buffer without a temporary per request.
+inline void append_request(std::vector<uint8_t>& out, const std::string_view* args, size_t n) {
+    size_t len = 4;
+    for (size_t i = 0; i < n; i++) {
+        len += 4 + args[i].size();
+    }
+    write_u32(out, len);
+    write_u32(out, n);
+    for (size_t i = 0; i < n; i++) {
+        write_str(out, args[i]);
+    }
+}
+
+inline std::vector<uint8_t> make_request(const std::vector<std::string>& cmd) {
+    std::vector<std::string_view> args(cmd.begin(), cmd.end());
+    std::vector<uint8_t> msg;
+    append_request(msg, args.data(), args.size());
+    return msg;
+}
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "aof.hpp"
+#include "repl.hpp"
+
+static struct {
+    std::mutex mu;
+    std::condition_variable cond;
+    std::vector<uint8_t> ring;
+    std::atomic<bool> active{false};
+    std::atomic<uint64_t> offset{0}; // bytes ever fed.
+    std::atomic<uint64_t> notified{0}; // offset of the last wakeup.
+    std::vector<uint8_t> scratch;    // one encoded record.
+    char id[41] = {};
+} g_repl;
+
+static void repl_init_id() {
+    uint8_t raw[20] = {};
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, raw, sizeof(raw)) != (ssize_t)sizeof(raw)) {
+        // good enough to tell two runs apart.
+        uint64_t t = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+        for (size_t i = 0; i < sizeof(raw); i++) {
+            raw[i] = (uint8_t)((t >> (i % 8 * 8)) ^ (getpid() >> (i % 4 * 8)));
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        snprintf(g_repl.id + 2 * i, 3, "%02x", raw[i]);
+    }
+}
+
+const char *repl_id() {
+    static std::once_flag once;
+    std::call_once(once, repl_init_id);
+    return g_repl.id;
+}
+
+void repl_backlog_start(size_t size) {
+    std::lock_guard<std::mutex> lock(g_repl.mu);
+    if (!g_repl.active) {
+        g_repl.ring.resize(size);
+        g_repl.active = true;
+    }
+}
+
+bool repl_backlog_active() {
+    return g_repl.active.load(std::memory_order_relaxed);
+}
+
+void repl_feed(const std::string_view *args, size_t nargs) {
+    if (!g_repl.active.load(std::memory_order_relaxed)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_repl.mu);
+    std::vector<uint8_t> &rec = g_repl.scratch;
+    rec.clear();
+    aof_encode(rec, args, nargs);
+    size_t cap = g_repl.ring.size();
+    uint64_t offset = g_repl.offset.load(std::memory_order_relaxed);
+    for (size_t done = 0; done < rec.size();) {
+        size_t pos = (offset + done) % cap;
+        size_t n = std::min(rec.size() - done, cap - pos);
+        memcpy(g_repl.ring.data() + pos, rec.data() + done, n);
+        done += n;
+    }
+    g_repl.offset.store(offset + rec.size(), std::memory_order_release);
+}
+
+uint64_t repl_offset() {
+    return g_repl.offset.load(std::memory_order_acquire);
+}
+
+bool repl_backlog_read(uint64_t from, std::vector<uint8_t> &out, size_t max) {
+    std::lock_guard<std::mutex> lock(g_repl.mu);
+    uint64_t offset = g_repl.offset.load(std::memory_order_relaxed);
+    size_t cap = g_repl.ring.size();
+    if (!g_repl.active || from > offset || offset - from > cap) {
+        return false;
+    }
+    size_t len = std::min<uint64_t>(offset - from, max);
+    for (size_t done = 0; done < len;) {
+        size_t pos = (from + done) % cap;
+        size_t n = std::min(len - done, cap - pos);
+        out.insert(out.end(), g_repl.ring.begin() + pos, g_repl.ring.begin() + pos + n);
+        done += n;
+    }
+    return true;
+}
+
+void repl_wait(uint64_t from, int timeout_ms) {
+    std::unique_lock<std::mutex> lock(g_repl.mu);
+    g_repl.cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [from] {
+        return g_repl.offset.load(std::memory_order_relaxed) > from;
+    });
+}
+
+void repl_notify() {
+    if (!g_repl.active.load(std::memory_order_relaxed)) {
+        return;
+    }
+    uint64_t offset = g_repl.offset.load(std::memory_order_relaxed);
+    if (g_repl.notified.load(std::memory_order_relaxed) == offset) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_repl.mu);
+    g_repl.notified.store(offset, std::memory_order_relaxed);
+    g_repl.cond.notify_all();
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// the primary's side of replication: the stream of commands replicas apply
+// is kept in a fixed-size ring, the backlog, so a replica that reconnects
+// after a short break continues where it left off instead of starting over
+// from a snapshot. positions are byte offsets in the stream since the
+// backlog was started.
+
+// this server's replication id: a stream position means something only
+// together with the id of the stream.
+const char *repl_id();
+
+// the backlog is created when the first replica syncs, call with every
+// shard lock held so its start is one point in the keyspace's history.
+void repl_backlog_start(size_t size);
+bool repl_backlog_active();
+
+// same contract as aof_feed(): with the key's shard lock held.
+void repl_feed(const std::string_view *args, size_t nargs);
+inline void repl_feed(const std::vector<std::string_view> &args) {
+    repl_feed(args.data(), args.size());
+}
+
+// end of stream.
+uint64_t repl_offset();
+// appends up to `max` bytes from `from` to `out`. false if `from` has been
+// overwritten already (or is ahead of the stream), the replica needs a
+// full resync then.
+bool repl_backlog_read(uint64_t from, std::vector<uint8_t> &out, size_t max);
+// blocks until the stream goes past `from`, or `timeout_ms` passed.
+void repl_wait(uint64_t from, int timeout_ms);
+// once per loop turn: wakes the senders if something was fed since.
+void repl_notify();
@@ -1,21 +1,45 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <linux/errqueue.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <iostream>
 #include <vector>
 #include <fcntl.h>
-#include <poll.h>
+#include <signal.h>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <climits>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <netdb.h>
 
 #include "util.hpp"
 #include "hashmap.hpp"
+#include "event_loop.hpp"
+#include "uring.hpp"
+#include "hash.hpp"
+#include "lazyfree.hpp"
+#include "crc32c.hpp"
+#include "aof.hpp"
+#include "repl.hpp"
+#include "histogram.hpp"
 
 using namespace std;
 
@@ -23,6 +47,40 @@ using namespace std;
 
 
 
+enum
+{
+    EVICT_NONE = 0, // noeviction: commands that need memory fail instead.
+    EVICT_ALLKEYS_LRU = 1,
+    EVICT_ALLKEYS_LFU = 2,
+    EVICT_VOLATILE_TTL = 3,
+};
+
+static const char *const k_evict_policies[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl",
+};
+
+static struct
+{
+    uint16_t port = 1234;
+    int backend = EV_BACKEND_EPOLL;
+    int nthreads = 1;
+    bool uring = false;
+    bool zerocopy = false; // MSG_ZEROCOPY for large values (readiness loop only).
+    uint64_t idle_timeout_ms = 300 * 1000; // 0: never close idle connections.
+    const char *dbfile = "dump.ldb"; // snapshot, loaded at startup.
+    const char *aof_file = nullptr;  // the command log, replaces the snapshot.
+    AofFsync appendfsync = AOF_FSYNC_EVERYSEC;
+    const char *primary_host = nullptr; // set on a replica.
+    uint16_t primary_port = 0;
+    size_t repl_backlog = 16 << 20;
+    int64_t slowlog_slower_than_us = 10000; // < 0: off, 0: every command.
+    size_t slowlog_max_len = 128;
+    uint64_t loop_stall_us = 100000; // 0: off.
+    uint64_t maxmemory = 0; // bytes, 0: no limit.
+    int maxmemory_policy = EVICT_NONE;
+    size_t maxmemory_samples = 5; // eviction candidates looked at per key evicted.
+} g_config;
+
 static void fd_set_nonblocking(int fd)
 {
     // file descriptor control.
@@ -39,16 +97,8 @@ static void fd_set_nonblocking(int fd)
     }
 }
 
-static Conn *handle_accept_new_client(int sockFd)
+static Conn *conn_new(int connfd, const struct sockaddr_in &client_addr)
 {
-    struct sockaddr_in client_addr = {};
-    socklen_t client_len = sizeof(client_addr);
-    int connfd = accept(sockFd, (struct sockaddr *)&client_addr, &client_len);
-    if (connfd < 0)
-    {
-        die("accept() failed");
-        return nullptr;
-    }
     uint32_t client_ip = client_addr.sin_addr.s_addr;
     uint16_t client_port = client_addr.sin_port;
 
@@ -63,74 +113,118 @@ static Conn *handle_accept_new_client(int sockFd)
     // set connfd to non-blocking mode.
     fd_set_nonblocking(connfd);
 
+    if (g_config.zerocopy)
+    {
+        int val = 1;
+        setsockopt(connfd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val));
+    }
+
     Conn *conn = new Conn();
     conn->fd = connfd;
+    snprintf(conn->addr, sizeof(conn->addr), "%u.%u.%u.%u:%u",
+             (client_ip >> 0) & 0xFF, (client_ip >> 8) & 0xFF,
+             (client_ip >> 16) & 0xFF, (client_ip >> 24) & 0xFF, ntohs(client_port));
     conn->want_read = true; // initially we want to read from the client.
     return conn;
 }
 
-static void append_to_buffer(vector<uint8_t> &buffer, const uint8_t *data, size_t len)
+static Conn *handle_accept_new_client(int sockFd)
+{
+    struct sockaddr_in client_addr = {};
+    socklen_t client_len = sizeof(client_addr);
+    int connfd = accept(sockFd, (struct sockaddr *)&client_addr, &client_len);
+    if (connfd < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return nullptr; // nothing to accept after all.
+    }
+    if (connfd < 0)
+    {
+        die("accept() failed");
+        return nullptr;
+    }
+    return conn_new(connfd, client_addr);
+}
+
+static void append_to_buffer(OutBuf &buffer, const uint8_t *data, size_t len)
 {
-    buffer.insert(buffer.end(), data, data + len);
+    out_append(&buffer, data, len);
 }
 
 // helper functions for serializing data into buffer.
-static void append_to_buffer_u8(vector<uint8_t> & buffer, uint8_t data){
+static void append_to_buffer_u8(OutBuf &buffer, uint8_t data){
     append_to_buffer(buffer, (const uint8_t*)&data, 1);
 }
 
-static void append_to_buffer_u32(vector<uint8_t> & buffer, uint32_t data){
+static void append_to_buffer_u32(OutBuf &buffer, uint32_t data){
     append_to_buffer(buffer, (const uint8_t*)&data, 4);
 }
 
-static void append_to_buffer_u64(vector<uint8_t> &buffer, uint64_t data){
+static void append_to_buffer_u64(OutBuf &buffer, uint64_t data){
     append_to_buffer(buffer, (const uint8_t*)& data, 8);
 }
 
-static void append_to_buffer_dbl(vector<uint8_t> &buffer, double data){
-    append_to_buffer(buffer, (const uint8_t*)&data, 4);
+static void append_to_buffer_dbl(OutBuf &buffer, double data){
+    append_to_buffer(buffer, (const uint8_t*)&data, 8);
 }
 
 // helper function for serializing the response.
-static void out_nil(vector<uint8_t> &buffer){
+static void out_nil(OutBuf &buffer){
     append_to_buffer_u8(buffer, TAG_NIL);
 }
 
-static void out_str(vector<uint8_t> &buffer , const char* s , size_t size){
+static void out_str(OutBuf &buffer , const char* s , size_t size){
     append_to_buffer_u8(buffer, TAG_STR);
     append_to_buffer_u32(buffer, (uint32_t)size);
     append_to_buffer(buffer, (const uint8_t*)s, size);
 }
 
-static void out_int(vector<uint8_t> &buffer, int64_t val){
+// same wire format as out_str, large values are referenced, not copied.
+static void out_blob(OutBuf &buffer, Blob *blob){
+    append_to_buffer_u8(buffer, TAG_STR);
+    append_to_buffer_u32(buffer, blob->len);
+    out_append_blob(&buffer, blob);
+}
+
+static void out_int(OutBuf &buffer, int64_t val){
     append_to_buffer_u8(buffer, TAG_INT);
     append_to_buffer_u64(buffer, val);
 }
 
-static void out_err(vector<uint8_t> &buffer, uint32_t code , const char* msg , size_t msg_len){
+static void out_err(OutBuf &buffer, uint32_t code , const char* msg , size_t msg_len){
     append_to_buffer_u8(buffer, TAG_ERR);
     append_to_buffer_u32(buffer, code);
     append_to_buffer_u32(buffer, (uint32_t) msg_len);
     append_to_buffer(buffer, (const uint8_t*) msg , msg_len);
 }
 
-static void out_dbl(vector<uint8_t> &buffer, double val){
+static void out_err(OutBuf &buffer, uint32_t code, const char *msg){
+    out_err(buffer, code, msg, strlen(msg));
+}
+
+static void out_dbl(OutBuf &buffer, double val){
     append_to_buffer_u8(buffer, TAG_DBL);
     append_to_buffer_dbl(buffer, val);
 }
 
 // just inits the array.
-static void out_array_header(vector<uint8_t> &buffer, uint32_t count){
+static void out_array_header(OutBuf &buffer, uint32_t count){
     append_to_buffer_u8(buffer, TAG_ARR);
     append_to_buffer_u32(buffer, count);
 }
 
+// for arrays whose size is only known at the end: returns where the count
+// goes, to be patched by out_end_arr(). the inline bytes do not move while
+// a request is being processed, nothing is written to the socket meanwhile.
+static size_t out_begin_arr(OutBuf &buffer){
+    out_array_header(buffer, 0);
+    return buf_len(&buffer.bytes) - 4;
+}
 
-// TODO: optimise this later (o(n) right now), replace this with a ring buffer or use begin and end pointers/offsets.
-static void buffer_consume(vector<uint8_t> &buffer, size_t n){
-    buffer.erase(buffer.begin() , buffer.begin() + n);
+static void out_end_arr(OutBuf &buffer, size_t ctx, uint32_t count){
+    memcpy(buf_data(&buffer.bytes) + ctx, &count, 4);
 }
 
+
 static int32_t read_u32(const uint8_t * &curr, const uint8_t* end , uint32_t &out){
     if(curr + 4 > end){
         return -1;
@@ -140,17 +234,21 @@ static int32_t read_u32(const uint8_t * &curr, const uint8_t* end , uint32_t &ou
     return 0;
 }
 
-static int32_t read_str(const uint8_t* &curr , const uint8_t*end , size_t n ,string &out){
+// no copy, the view points into the receive buffer.
+static int32_t read_str(const uint8_t* &curr , const uint8_t*end , size_t n ,string_view &out){
     if(curr  + n> end){
         return -1;
     }
-    out.assign(curr, curr+ n );
+    out = string_view((const char *)curr, n);
     curr += n ;
     return 0;
 }
 
-static int32_t parse_request(const uint8_t* data , size_t size, vector<string> & out)
+// `out` is reused across requests, so parsing does not allocate once it has
+// grown to the widest command seen on the connection.
+static int32_t parse_request(const uint8_t* data , size_t size, vector<string_view> & out)
 {
+    out.clear();
     const uint8_t *end = data + size;
     uint32_t nstr  = 0; 
     if(read_u32(data , end , nstr) < 0){
@@ -167,7 +265,7 @@ static int32_t parse_request(const uint8_t* data , size_t size, vector<string> &
             return -1;
         }
 
-        out.push_back(string()); // push one empty string.
+        out.push_back(string_view()); // push one empty view.
         if(read_str(data , end , len , out.back()) < 0){
             return -1;
         }
@@ -179,326 +277,3324 @@ static int32_t parse_request(const uint8_t* data , size_t size, vector<string> &
 }
 
 
-// static HashMap g_db;
-static struct {
+// the keyspace is split into hash-partitioned shards, each with its own lock,
+// so event-loop threads only contend when they touch the same shard.
+const size_t k_nshards = 64;
+
+struct Shard {
+    std::mutex mu;
     HashMap hmap;
+    Slab slab; // entry blocks, used under `mu`.
+    vector<HeapItem> ttl_heap; // deadlines (monotonic ms) of keys with a TTL.
+    // ttl_heap's earliest deadline, readable without the lock.
+    std::atomic<uint64_t> next_expire{UINT64_MAX};
+    size_t val_mem = 0; // blobs and sorted sets held by the entries.
+    size_t mem = 0;     // all of the shard, as last added to the used memory.
+};
+
+static struct {
+    Shard shards[k_nshards];
 } g_db;
 
-static bool entry_eq(HashNode *lhs, HashNode *rhs) {
-    struct Entry *le = container_of(lhs,  Entry, node);
-    struct Entry *re = container_of(rhs,  Entry, node);
-    return le->key == re->key;
+static Shard *shard_for(uint64_t hcode) {
+    // middle bits: the low bits pick the bucket inside the shard and the
+    // top 7 bits are the swiss table's tag.
+    return &g_db.shards[(hcode >> 40) & (k_nshards - 1)];
 }
 
-// FNV hash
-static uint64_t str_hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        h = (h + data[i]) * 0x01000193;
+// ---- memory ----
+// a shard's bytes are counted under its lock: the entry blocks (slab), the
+// values kept outside them (blobs, sorted sets), the hash table and the TTL
+// heap. a thread sums its changes in t_mem_delta and publishes them once per
+// command or loop turn into g_mem_used, which maxmemory is checked against.
+// values handed to the lazyfree thread no longer count.
+
+static std::atomic<int64_t> g_mem_used{0};
+static thread_local int64_t t_mem_delta = 0;
+static std::atomic<uint64_t> g_evicted{0};
+
+static void mem_flush() {
+    if (t_mem_delta) {
+        g_mem_used.fetch_add(t_mem_delta, std::memory_order_relaxed);
+        t_mem_delta = 0;
     }
-    return h;
 }
 
-static bool cb_keys(HashNode* node, void* arg) {
-    // Pointer-style (valid, but more verbose)
-    // vector<uint8_t> *out = (vector<uint8_t> *)arg;
+// recounts the shard after a change, O(1).
+static void shard_sync_mem(Shard *sh) {
+    size_t mem = sh->slab.bytes_used + sh->val_mem + hmap_mem(&sh->hmap)
+               + sh->ttl_heap.capacity() * sizeof(HeapItem);
+    t_mem_delta += (int64_t)mem - (int64_t)sh->mem;
+    sh->mem = mem;
+}
 
-    // Reference-style (preferred)
-    vector<uint8_t> &out = *(vector<uint8_t> *)arg;
+// the eviction clock: monotonic time in 10ms ticks, published by the event
+// loops. 32 bits last 497 days; an idle time is the wrapping difference to
+// the stamp of the entry.
+const uint64_t k_lru_tick_ms = 10;
+static std::atomic<uint32_t> g_lru_clock{0};
 
-    const std::string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
-    return true;   // continue iteration
+static void lru_clock_update(uint64_t now_ms) {
+    uint32_t clock = (uint32_t)(now_ms / k_lru_tick_ms);
+    if (g_lru_clock.load(std::memory_order_relaxed) != clock) {
+        g_lru_clock.store(clock, std::memory_order_relaxed); // only when it moved.
+    }
 }
 
-static void do_keys (vector<string> &cmd,  vector<uint8_t> &out){
-    // init the array header.
-    out_array_header(out, hmap_size(&g_db.hmap));
-    hmap_for_each_key(&g_db.hmap, &cb_keys , (void *) &out);
+// LFU, as in redis: the minute of the last access in the upper 24 bits and
+// a logarithmic counter in the lower 8. the counter goes up with probability
+// 1 / ((counter - 5) * 10 + 1) and down by one per idle minute, so it tells
+// what is popular now rather than what was ever hit a lot.
+const uint32_t k_lfu_init = 5;
+const uint32_t k_lfu_log_factor = 10;
+const uint32_t k_lfu_minute_ticks = 60 * 1000 / k_lru_tick_ms;
+
+static uint64_t rand_u64() {
+    static thread_local uint64_t s = 0;
+    if (!s) {
+        s = (uint64_t)(uintptr_t)&s * 0x9E3779B97F4A7C15ull | 1;
+    }
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
 }
 
-static void do_get(vector<string> &cmd,  vector<uint8_t> &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hCode = str_hash(
-        (uint8_t *)key.key.data(), key.key.size());
+static uint32_t lfu_minutes() {
+    return g_lru_clock.load(std::memory_order_relaxed) / k_lfu_minute_ticks & 0xFFFFFF;
+}
 
-    HashNode *node = hmap_lookup(&g_db.hmap, &key.node, entry_eq);
-    if (!node) {
-        return out_nil(out);
+static uint32_t lfu_counter(uint32_t access, uint32_t now_min) {
+    uint32_t counter = access & 0xFF;
+    uint32_t idle = (now_min - (access >> 8)) & 0xFFFFFF;
+    return idle >= counter ? 0 : counter - idle;
+}
+
+// on every lookup that finds the key, a store into a line already loaded.
+static void entry_touch(Entry *ent) {
+    if (g_config.maxmemory_policy == EVICT_ALLKEYS_LRU) {
+        ent->access = g_lru_clock.load(std::memory_order_relaxed);
+    } else if (g_config.maxmemory_policy == EVICT_ALLKEYS_LFU) {
+        uint32_t now = lfu_minutes();
+        uint32_t counter = lfu_counter(ent->access, now);
+        if (counter < 255) {
+            uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+            counter += rand_u64() % (base * k_lfu_log_factor + 1) == 0;
+        }
+        ent->access = now << 8 | counter;
     }
+}
 
-    const string &val = container_of(node, Entry, node)->val;
-    return out_str(out, val.data(), val.size());
+static size_t entry_size(size_t klen, size_t vlen) {
+    return offsetof(Entry, data) + klen + vlen;
 }
 
-static void do_set(vector<string> &cmd,      vector<uint8_t> &out) {
-    Entry probe;
-    probe.key.swap(cmd[1]);
-    probe.node.hCode = str_hash(
-        (uint8_t *)probe.key.data(), probe.key.size());
+static string_view entry_key(const Entry *ent) {
+    return string_view(ent->data, ent->klen);
+}
 
-    HashNode *node = hmap_lookup(&g_db.hmap, &probe.node, entry_eq);
-    if (node) {
-        container_of(node, Entry, node)->val.swap(cmd[2]);
-    } else {
-        Entry *ent = new Entry();
-        ent->key.swap(probe.key);
-        ent->val.swap(cmd[2]);
-        ent->node.hCode = probe.node.hCode;
-        hmap_insert(&g_db.hmap, &ent->node);
+static Blob *entry_blob(const Entry *ent) {
+    Blob *blob = nullptr;
+    if (ent->flags & ENT_BLOB) {
+        memcpy(&blob, ent->data + ent->klen, sizeof(blob)); // unaligned.
     }
+    return blob;
+}
 
-    return out_nil(out);
+static ZSet *entry_zset(const Entry *ent) {
+    ZSet *zset = nullptr;
+    if (ent->type == T_ZSET) {
+        memcpy(&zset, ent->data + ent->klen, sizeof(zset));
+    }
+    return zset;
+}
+
+// a decimal integer in its one canonical form (no sign but '-', no leading
+// zeros), so that formatting it again gives back the same bytes.
+static bool int_parse(const char *s, size_t len, int64_t &out) {
+    const char *end = s + len;
+    bool neg = len > 0 && *s == '-';
+    s += neg;
+    if (s == end || end - s > 19 || (*s == '0' && (end - s > 1 || neg))) {
+        return false;
+    }
+    uint64_t v = 0;
+    for (; s < end; s++) {
+        if (*s < '0' || *s > '9') {
+            return false;
+        }
+        v = v * 10 + (*s - '0'); // 19 digits fit in 64 bits.
+    }
+    if (v > (uint64_t)INT64_MAX + neg) {
+        return false;
+    }
+    out = neg ? (int64_t)(0 - v) : (int64_t)v;
+    return true;
 }
 
+// the text of an integer value, for whatever needs the string.
+static string_view int_format(int64_t v, char (&buf)[24]) {
+    int len = snprintf(buf, sizeof(buf), "%lld", (long long)v);
+    return string_view(buf, len);
+}
 
-static void do_del(vector<string> &cmd,  vector<uint8_t> &out) {
-    Entry probe;
-    probe.key.swap(cmd[1]);
-    probe.node.hCode = str_hash(
-        (uint8_t *)probe.key.data(), probe.key.size());
+static int64_t entry_int(const Entry *ent) {
+    int64_t v = 0;
+    memcpy(&v, ent->data + ent->klen, sizeof(v)); // unaligned.
+    return v;
+}
 
-    HashNode *node = hmap_delete(&g_db.hmap, &probe.node, entry_eq);
-    if (node) {
-        delete container_of(node, Entry, node);
+// the bytes a string value takes in the block: integers are stored as
+// int64_t, so INCR works on them in place, large values as a Blob *.
+static size_t entry_vlen(string_view val, const Blob *blob) {
+    int64_t v;
+    if (blob || int_parse(val.data(), val.size(), v)) {
+        return 8;
     }
+    return val.size();
+}
 
-    return out_nil(out);
+// a new block with room for `vlen` value bytes, the value is set later.
+static Entry *entry_new(Shard *sh, string_view key, uint64_t hcode, size_t vlen) {
+    uint8_t cls = 0;
+    void *mem = slab_alloc(&sh->slab, entry_size(key.size(), vlen), &cls);
+    Entry *ent = new (mem) Entry();
+    ent->node.hCode = hcode;
+    ent->klen = (uint32_t)key.size();
+    ent->cls = cls;
+    if (g_config.maxmemory_policy == EVICT_ALLKEYS_LFU) {
+        ent->access = lfu_minutes() << 8 | k_lfu_init;
+    } else {
+        ent->access = g_lru_clock.load(std::memory_order_relaxed);
+    }
+    memcpy(ent->data, key.data(), key.size());
+    shard_sync_mem(sh);
+    return ent;
 }
 
+// whether the block can take a value area of `vlen` bytes in place.
+static bool entry_fits(const Entry *ent, size_t vlen) {
+    size_t cap = slab_class_size(ent->cls);
+    if (!cap) {
+        // malloc()ed at the exact size, which slab_free() is told again:
+        // it must not change.
+        return entry_size(ent->klen, vlen) == entry_size(ent->klen, ent->vlen);
+    }
+    return entry_size(ent->klen, vlen) <= cap;
+}
 
-static void do_request(vector<string> &cmd,  vector<uint8_t> &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
+// values unlinked under a shard lock are collected here and released after
+// the command, once every lock has been dropped, so freeing never blocks
+// other threads on the shard. large ones go to the lazyfree thread unless
+// the command frees synchronously (del).
+static thread_local vector<Garbage> t_garbage;
+
+static void garbage_release(bool lazy) {
+    for (Garbage &dead : t_garbage) {
+        if (lazy && garbage_is_big(dead)) {
+            lazyfree_push(dead);
+        } else {
+            garbage_free(dead);
+        }
     }
-    else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
+    t_garbage.clear();
+}
+
+// bytes of the value outside the entry block.
+static size_t entry_val_mem(const Entry *ent) {
+    if (Blob *blob = entry_blob(ent)) {
+        return sizeof(Blob) + blob->len;
     }
-    else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    }else if (cmd.size() ==1 && cmd[0] == "keys"){
-        return do_keys(cmd, out);
-    }else {
-        string err_msg = "unknown command";
-        return out_err(out, ERR_UNKNOWN, err_msg.data(), err_msg.size());
-        
+    if (ZSet *zset = entry_zset(ent)) {
+        return sizeof(ZSet) + zset_mem(zset);
     }
+    return 0;
 }
 
+// moves the current value out, before it is overwritten.
+static void entry_take_val(Shard *sh, Entry *ent) {
+    Garbage dead;
+    dead.blob = entry_blob(ent);
+    dead.zset = entry_zset(ent);
+    if (dead.blob || dead.zset) {
+        sh->val_mem -= entry_val_mem(ent);
+        shard_sync_mem(sh);
+        t_garbage.push_back(dead);
+    }
+}
 
-// static void serialise_response(const Response &resp, vector<uint8_t> &out){
-//     uint32_t resp_len = 4 + (uint32_t) resp.payload.size(); // 4 for status , and then payload.
-//     append_to_buffer(out, (const uint8_t *)&resp_len, 4 );
-//     append_to_buffer(out , (const uint8_t *)& resp.status , 4);
-//     append_to_buffer(out , resp.payload.data()  , resp.payload.size());
-// }
+static uint64_t get_monotonic_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
 
-static void start_serialise_response(vector<uint8_t> &out, size_t &header_pos){
-    header_pos = out.size();
-    // reserve space for total length - 4 bytes.
-    append_to_buffer_u32(out, 0);
+// wall-clock time, for deadlines that outlive the process (files, replicas).
+static uint64_t get_realtime_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
-static size_t response_payload_size(vector<uint8_t> &out , size_t header_pos){
-    return out.size()   - header_pos - 4;
+// publish the earliest deadline after ttl_heap changed.
+static void shard_sync_expire(Shard *sh) {
+    uint64_t next = sh->ttl_heap.empty() ? UINT64_MAX : sh->ttl_heap[0].val;
+    sh->next_expire.store(next, std::memory_order_relaxed);
 }
 
-static void end_serialise_response(vector<uint8_t> &out, size_t header_pos){
-    size_t total_msg_size = response_payload_size(out , header_pos);
-    if(total_msg_size > k_max_msg){
-        out.resize(header_pos + 4); // discard the whole message.
-        string err_msg = "response too big";
-        out_err(out, ERR_TOO_BIG, err_msg.data(), err_msg.size());
-        total_msg_size = response_payload_size(out , header_pos);
+// deadline in monotonic ms, or UINT64_MAX to drop the TTL.
+static void entry_set_ttl(Shard *sh, Entry *ent, uint64_t deadline) {
+    if (deadline == UINT64_MAX) {
+        if (ent->ttl_idx == k_heap_none) {
+            return;
+        }
+        heap_remove(sh->ttl_heap, ent->ttl_idx);
+    } else if (ent->ttl_idx == k_heap_none) {
+        heap_push(sh->ttl_heap, HeapItem{deadline, &ent->ttl_idx});
+    } else {
+        heap_set(sh->ttl_heap, ent->ttl_idx, deadline);
     }
-    // fill in the total length of the message at header_pos.
-    uint32_t total_size_u32 = (uint32_t) total_msg_size;
-    memcpy(&out[header_pos], &total_size_u32, 4);
+    shard_sync_expire(sh);
+    shard_sync_mem(sh);
 }
 
-// actually parses the data accoring to our protocol.
-static bool try_one_request(Conn *conn)
-{
-    if (conn->incoming.size() < 4)
-    {
-        return false;
-    }
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
+static void entry_set_int(Entry *ent, int64_t v) {
+    ent->type = T_STR;
+    ent->flags = (ent->flags & ~ENT_BLOB) | ENT_INT;
+    ent->vlen = sizeof(v);
+    memcpy(ent->data + ent->klen, &v, sizeof(v));
+}
 
-    if (len > k_max_msg)
-    {
-        msg("append_to_buffer() too long");
-        conn->want_close = true;
-        return false;
+// the caller must have checked entry_fits() with entry_vlen() and taken the
+// previous value.
+static void entry_set_val(Shard *sh, Entry *ent, const char *data, size_t len, Blob *blob) {
+    int64_t v;
+    if (!blob && int_parse(data, len, v)) {
+        return entry_set_int(ent, v);
     }
-
-    if (4 + len > conn->incoming.size())
-    {
-        // more data is yet to arrive
-        return false;
+    ent->type = T_STR;
+    ent->flags &= ~ENT_INT;
+    if (blob) {
+        ent->flags |= ENT_BLOB;
+        ent->vlen = sizeof(blob);
+        memcpy(ent->data + ent->klen, &blob, sizeof(blob));
+        sh->val_mem += sizeof(Blob) + blob->len;
+        shard_sync_mem(sh);
+    } else {
+        ent->flags &= ~ENT_BLOB;
+        ent->vlen = (uint32_t)len;
+        memcpy(ent->data + ent->klen, data, len);
     }
+}
 
-    uint8_t *request = &conn->incoming[4];
+static void entry_set_zset(Shard *sh, Entry *ent, ZSet *zset) {
+    ent->type = T_ZSET;
+    ent->flags &= ~(ENT_BLOB | ENT_INT);
+    ent->vlen = sizeof(zset);
+    memcpy(ent->data + ent->klen, &zset, sizeof(zset));
+    sh->val_mem += sizeof(ZSet) + zset_mem(zset);
+    shard_sync_mem(sh);
+}
 
-    // ----- application level parsing ----
-    vector<string> cmd;
-    if(parse_request(request, len , cmd) < 0) {
-        msg("bad request");
-        conn->want_close = true;
-        return false;
-    }
+// after members were added to or removed from a stored set, `old_mem` is
+// zset_mem() from before.
+static void entry_zset_resized(Shard *sh, ZSet *zset, size_t old_mem) {
+    sh->val_mem += zset_mem(zset) - old_mem;
+    shard_sync_mem(sh);
+}
 
-    // ---- execute and serialise -----
+// hmap_insert(), then counts the table, which may have grown.
+static void shard_insert(Shard *sh, Entry *ent) {
+    hmap_insert(&sh->hmap, &ent->node);
+    shard_sync_mem(sh);
+}
 
-    size_t header_pos = 0;
-    start_serialise_response (conn->outgoing, header_pos);
-    do_request(cmd, conn->outgoing);
-    end_serialise_response(conn->outgoing , header_pos);
+// the entry must be unlinked already, its value goes to t_garbage.
+static void entry_free(Shard *sh, Entry *ent) {
+    entry_set_ttl(sh, ent, UINT64_MAX);
+    entry_take_val(sh, ent);
+    slab_free(&sh->slab, ent, entry_size(ent->klen, ent->vlen), ent->cls);
+    shard_sync_mem(sh);
+}
 
-    // remove request from incoming buffer.
-    buffer_consume(conn->incoming , 4 + len); 
+static void out_entry_val(OutBuf &out, const Entry *ent) {
+    if (Blob *blob = entry_blob(ent)) {
+        // takes a reference, so the value may be replaced before it is written.
+        return out_blob(out, blob);
+    }
+    if (ent->flags & ENT_INT) {
+        char buf[24];
+        string_view val = int_format(entry_int(ent), buf);
+        return out_str(out, val.data(), val.size());
+    }
+    return out_str(out, ent->data + ent->klen, ent->vlen);
+}
 
-    return true;
+// `node` is a stored Entry, `key` the LookupKey being probed.
+static bool entry_eq(HashNode *node, HashNode *key) {
+    struct Entry *ent = container_of(node,  Entry, node);
+    struct LookupKey *lk = container_of(key,  LookupKey, node);
+    return entry_key(ent) == lk->key;
 }
 
-static void handle_write(Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+// replaying the log at startup: keys do not expire until it is done, the
+// log itself decides what happens to them.
+static bool g_loading = false;
+// the replica thread applies the primary's stream whatever the deadlines
+// say: the primary decides when a key expires and sends a del for it.
+static thread_local bool t_replicating = false;
+
+// hands a change to the log and to the replicas, with the key's shard lock
+// held so both see the changes in the order the keyspace did.
+static void propagate(const string_view *args, size_t nargs) {
+    aof_feed(args, nargs);
+    repl_feed(args, nargs);
+}
 
-    if(rv < 0 && errno == EAGAIN){
-        // data not ready now, try again in the next iteration.
-        return;
+static void propagate(const vector<string_view> &args) {
+    propagate(args.data(), args.size());
+}
+
+// deletes a key that the server drops on its own (expired, evicted). the
+// log and the replicas get a del instead of deciding for themselves: their
+// clock differs, and a write that follows must find the key in the same
+// state on replay and on every replica.
+static void entry_drop(Shard *sh, Entry *ent) {
+    LookupKey key;
+    key.key = entry_key(ent);
+    key.node.hCode = ent->node.hCode;
+    HashNode *node = hmap_delete(&sh->hmap, &key.node, entry_eq);
+    assert(node == &ent->node);
+    (void)node;
+    string_view args[2] = {"del", key.key};
+    propagate(args, 2);
+    entry_free(sh, ent);
+}
+
+// hmap_lookup() that treats a key past its deadline as missing and drops
+// it; active expiration may lag behind under mass expiry.
+// `now` is the clock to judge the deadline by: a batch passes one reading
+// for all its keys, so a key named twice cannot expire between its lookups
+// and free an Entry the first one returned.
+static Entry *entry_lookup(Shard *sh, LookupKey &key, uint64_t now) {
+    HashNode *node = hmap_lookup(&sh->hmap, &key.node, entry_eq);
+    if (!node) {
+        return nullptr;
     }
-    if(rv < 0){
-        msg("handle_write() failed");
-        conn->want_close = true;
-        return;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->ttl_idx != k_heap_none && !g_loading && !t_replicating
+        && sh->ttl_heap[ent->ttl_idx].val <= now) {
+        if (!g_config.primary_host) {
+            entry_drop(sh, ent);
+        }
+        return nullptr; // a replica waits for the del of its primary.
     }
-    // remove consumed data from buffer.
-    buffer_consume(conn->outgoing , size_t(rv));
+    entry_touch(ent);
+    return ent;
+}
 
-    // if all data written -> readiness intention.
-    if(conn->outgoing.size() ==0){
-        conn->want_read = true;
-        conn->want_write = false;
-    } // else continue write.
+static Entry *entry_lookup(Shard *sh, LookupKey &key) {
+    return entry_lookup(sh, key, get_monotonic_msec());
 }
 
-static void handle_read(Conn *conn)
-{
-    uint8_t buffer[64 * 1024]; // 64 KB buffer
-    ssize_t rv = read(conn->fd, buffer, sizeof(buffer));
+static bool cb_keys(HashNode* node, void* arg) {
+    // Pointer-style (valid, but more verbose)
+    // OutBuf *out = (OutBuf *)arg;
 
-    if (rv < 0 && errno == EAGAIN)
-    {
-        // no data available right now.
-        // eagain is a error code that means the operation cannot be completed immediately because it would block but may succeed later.
-        return;
+    // Reference-style (preferred)
+    OutBuf &out = *(OutBuf *)arg;
+
+    string_view key = entry_key(container_of(node, Entry, node));
+    out_str(out, key.data(), key.size());
+    return true;   // continue iteration
+}
+
+// every key in one response while holding every shard lock: for debugging
+// small stores, scan is the incremental way to walk the keyspace.
+static void do_keys (vector<string_view> &cmd,  OutBuf &out){
+    // lock every shard (always in the same order) so the count matches the keys.
+    size_t total = 0;
+    for (Shard &sh : g_db.shards) {
+        sh.mu.lock();
+        total += hmap_size(&sh.hmap);
     }
-    if (rv < 0)
-    {
-        // actual error
-        msg("read() failed");
-        conn->want_close = true;
-        return;
+    // init the array header.
+    out_array_header(out, total);
+    for (Shard &sh : g_db.shards) {
+        hmap_for_each_key(&sh.hmap, &cb_keys , (void *) &out);
+        sh.mu.unlock();
     }
+}
 
-    // eof
-    if (rv == 0)
-    {
-        if (conn->incoming.empty())
-        {
-            msg("client closed connection");
-        }
-        else
-        {
-            msg("client closed connection with pending data");
+static void do_get(vector<string_view> &cmd,  OutBuf &out) {
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hCode = hash_bytes(key.key.data(), key.key.size());
+
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+    Entry *ent = entry_lookup(sh, key);
+    if (!ent) {
+        return out_nil(out);
+    }
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "expect string type");
+    }
+    return out_entry_val(out, ent);
+}
+
+// the only place where request bytes are copied: into the stored entry.
+// large values are copied into their Blob before taking the lock.
+static Blob *val_blob(string_view val) {
+    return val.size() >= k_out_ref_min ? blob_new(val.data(), val.size()) : nullptr;
+}
+
+// stores `val` (already in `blob` if large) at `probe`, with the lock held.
+static void set_locked(Shard *sh, LookupKey &probe, string_view val, Blob *blob) {
+    size_t vlen = entry_vlen(val, blob);
+    Entry *ent = entry_lookup(sh, probe);
+    if (ent && entry_fits(ent, vlen)) {
+        entry_take_val(sh, ent);
+        entry_set_ttl(sh, ent, UINT64_MAX); // set replaces the TTL too.
+        entry_set_val(sh, ent, val.data(), val.size(), blob);
+    } else {
+        if (ent) {
+            // outgrew its block: move the pair into a larger one.
+            hmap_delete(&sh->hmap, &probe.node, entry_eq);
+            entry_free(sh, ent);
         }
-        conn->want_close = true;
-        return;
+        ent = entry_new(sh, probe.key, probe.node.hCode, vlen);
+        entry_set_val(sh, ent, val.data(), val.size(), blob);
+        shard_insert(sh, ent);
     }
+}
 
-    // append new data to incoming buffer
-    append_to_buffer(conn->incoming, buffer, (size_t)rv);
+static void do_set(vector<string_view> &cmd,      OutBuf &out) {
+    LookupKey probe;
+    probe.key = cmd[1];
+    probe.node.hCode = hash_bytes(probe.key.data(), probe.key.size());
 
-    // pipeling.
-    while (try_one_request(conn));
+    Shard *sh = shard_for(probe.node.hCode);
+    Blob *blob = val_blob(cmd[2]);
+    std::lock_guard<std::mutex> lock(sh->mu);
+    set_locked(sh, probe, cmd[2], blob);
+    propagate(cmd);
+    return out_nil(out);
+}
 
-    if(conn->outgoing.size() > 0){
-        conn->want_read= false;
-        conn->want_write= true;
-        return handle_write(conn);
+
+// incr, decr, incrby, decrby: the new value as an int. a missing key
+// starts from 0, the TTL is kept. once the value is stored as an integer,
+// this is an add in place: one round trip and no allocation.
+static void incr_by(vector<string_view> &cmd, OutBuf &out, int64_t delta) {
+    LookupKey probe;
+    probe.key = cmd[1];
+    probe.node.hCode = hash_bytes(probe.key.data(), probe.key.size());
+
+    Shard *sh = shard_for(probe.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+    Entry *ent = entry_lookup(sh, probe);
+    int64_t val = 0;
+    if (ent && ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "expect string type");
+    }
+    if (ent && !(ent->flags & ENT_INT)) {
+        // set stores every integer as one, any other string is not.
+        return out_err(out, ERR_BAD_ARG, "value is not an integer");
+    }
+    if (ent) {
+        val = entry_int(ent);
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_BAD_ARG, "increment or decrement would overflow");
     }
+    if (ent) {
+        memcpy(ent->data + ent->klen, &val, sizeof(val));
+    } else {
+        ent = entry_new(sh, probe.key, probe.node.hCode, sizeof(val));
+        entry_set_int(ent, val);
+        shard_insert(sh, ent);
+    }
+    propagate(cmd);
+    return out_int(out, val);
 }
 
+static void do_incr(vector<string_view> &cmd, OutBuf &out) { incr_by(cmd, out, 1); }
+static void do_decr(vector<string_view> &cmd, OutBuf &out) { incr_by(cmd, out, -1); }
 
-
-int main()
-{
-    printf("server up and running");
-    int sockFd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockFd < 0)
-    {
-        die("socket() failed");
+static void do_incrby(vector<string_view> &cmd, OutBuf &out) {
+    int64_t delta = 0;
+    if (!int_parse(cmd[2].data(), cmd[2].size(), delta)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
     }
+    incr_by(cmd, out, delta);
+}
 
-    int val = 1;
-    if (setsockopt(sockFd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0)
-    {
-        die("setsockopt() failed");
+static void do_decrby(vector<string_view> &cmd, OutBuf &out) {
+    int64_t delta = 0;
+    if (!int_parse(cmd[2].data(), cmd[2].size(), delta) || delta == INT64_MIN) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
     }
+    incr_by(cmd, out, -delta);
+}
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(1234);
-    addr.sin_addr.s_addr = htonl(0); // wildcard address
+static void del_key(vector<string_view> &cmd,  OutBuf &out, bool lazy) {
+    LookupKey probe;
+    probe.key = cmd[1];
+    probe.node.hCode = hash_bytes(probe.key.data(), probe.key.size());
 
-    int rv = bind(sockFd, (struct sockaddr *)&addr, sizeof(addr));
-    if (rv < 0)
+    Shard *sh = shard_for(probe.node.hCode);
     {
-        die("bind() failed");
+        std::lock_guard<std::mutex> lock(sh->mu);
+        HashNode *node = hmap_delete(&sh->hmap, &probe.node, entry_eq);
+        if (node) {
+            entry_free(sh, container_of(node, Entry, node));
+            propagate(cmd);
+        }
     }
+    // del frees the value on this thread, as in redis. unlink detaches the
+    // key just the same, and leaves a large value to the lazyfree thread.
+    garbage_release(lazy);
+    return out_nil(out);
+}
 
-    // set the listening socket to non-blocking mode.
-    fd_set_nonblocking(sockFd);
+static void do_del(vector<string_view> &cmd, OutBuf &out) { del_key(cmd, out, false); }
+static void do_unlink(vector<string_view> &cmd, OutBuf &out) { del_key(cmd, out, true); }
 
-    rv = listen(sockFd, 10);
-    if (rv < 0)
-    {
-        die("listen() failed");
-    }
-    vector<Conn *> fd2Conn;
-    vector<struct pollfd> poll_args;
 
-    while (true)
-    {
-        poll_args.clear();
+static bool str2dbl(string_view s, double &out) {
+    string tmp(s); // strtod() wants a terminated string.
+    char *endp = nullptr;
+    out = strtod(tmp.c_str(), &endp);
+    return !tmp.empty() && endp == tmp.c_str() + tmp.size() && !isnan(out);
+}
 
-        struct pollfd listen_pfd = {sockFd, POLLIN, 0};
-        poll_args.push_back(listen_pfd);
+static bool str2int(string_view s, int64_t &out) {
+    string tmp(s);
+    char *endp = nullptr;
+    errno = 0;
+    out = strtoll(tmp.c_str(), &endp, 10);
+    return !tmp.empty() && endp == tmp.c_str() + tmp.size() && errno == 0;
+}
 
-        for (Conn *conn : fd2Conn)
-        {
-            if (conn == nullptr)
-                continue;
+// the sorted set stored at `key`. `zset` stays null if the key is missing,
+// an error is written if it holds another type. call with the lock held.
+static bool lookup_zset(Shard *sh, LookupKey &key, OutBuf &out, ZSet *&zset) {
+    zset = nullptr;
+    Entry *ent = entry_lookup(sh, key);
+    if (!ent) {
+        return true;
+    }
+    if (ent->type != T_ZSET) {
+        out_err(out, ERR_BAD_TYP, "expect zset");
+        return false;
+    }
+    zset = entry_zset(ent);
+    return true;
+}
 
-            // always poll for error.
+static void lookup_key_init(LookupKey &key, string_view name) {
+    key.key = name;
+    key.node.hCode = hash_bytes(name.data(), name.size());
+}
 
-            struct pollfd pfd = {conn->fd, POLLERR, 0};
-            if (conn->want_read)
-            {
-                pfd.events |= POLLIN;
+// ---- multi-key commands ----
+// a batch of keys is resolved in passes: hash every key, lock each shard
+// involved once (in index order, as lock_all_shards() does), prefetch the
+// bucket heads of every key, then the nodes they point to, and only then
+// walk the chains. the cache misses of the keys overlap instead of adding
+// up one after another.
+struct KeyBatch {
+    vector<LookupKey> keys;
+    vector<uint32_t> order; // indexes into `keys`, grouped by shard.
+    vector<Shard *> locked;
+};
+
+static thread_local KeyBatch t_batch;
+
+static size_t shard_index(uint64_t hcode) {
+    return shard_for(hcode) - g_db.shards;
+}
+
+// the keys are cmd[first], cmd[first + step], ...
+static KeyBatch &batch_begin(vector<string_view> &cmd, size_t first, size_t step) {
+    KeyBatch &b = t_batch;
+    b.keys.clear();
+    b.order.clear();
+    for (size_t i = first; i < cmd.size(); i += step) {
+        b.keys.emplace_back();
+        lookup_key_init(b.keys.back(), cmd[i]);
+        b.order.push_back((uint32_t)b.order.size());
+    }
+    // stable: a key given twice is handled in the order of the request.
+    std::stable_sort(b.order.begin(), b.order.end(), [&b](uint32_t x, uint32_t y) {
+        return shard_index(b.keys[x].node.hCode) < shard_index(b.keys[y].node.hCode);
+    });
+    b.locked.clear();
+    for (uint32_t i : b.order) {
+        Shard *sh = shard_for(b.keys[i].node.hCode);
+        if (b.locked.empty() || b.locked.back() != sh) {
+            sh->mu.lock();
+            b.locked.push_back(sh);
+        }
+    }
+    for (uint32_t i : b.order) {
+        LookupKey &key = b.keys[i];
+        hmap_prefetch(&shard_for(key.node.hCode)->hmap, key.node.hCode);
+    }
+    for (uint32_t i : b.order) {
+        LookupKey &key = b.keys[i];
+        hmap_prefetch_node(&shard_for(key.node.hCode)->hmap, key.node.hCode);
+    }
+    return b;
+}
+
+static void batch_end(KeyBatch &b) {
+    for (Shard *sh : b.locked) {
+        sh->mu.unlock();
+    }
+    b.locked.clear();
+}
+
+// mget key...: an array with a value or nil per key (nil for other types).
+static void do_mget(vector<string_view> &cmd, OutBuf &out) {
+    KeyBatch &b = batch_begin(cmd, 1, 1);
+    thread_local vector<Entry *> ents;
+    ents.assign(b.keys.size(), nullptr);
+    uint64_t now = get_monotonic_msec();
+    for (uint32_t i : b.order) {
+        LookupKey &key = b.keys[i];
+        Entry *ent = entry_lookup(shard_for(key.node.hCode), key, now);
+        ents[i] = ent && ent->type == T_STR ? ent : nullptr;
+    }
+    // still locked: small values are copied out, blobs gain a reference.
+    out_array_header(out, (uint32_t)ents.size());
+    for (Entry *ent : ents) {
+        if (ent) {
+            out_entry_val(out, ent);
+        } else {
+            out_nil(out);
+        }
+    }
+    batch_end(b);
+}
+
+// mset key value...: every pair is visible at once, the shards stay locked
+// until all of them are stored.
+static void do_mset(vector<string_view> &cmd, OutBuf &out) {
+    if (cmd.size() % 2 == 0) {
+        return out_err(out, ERR_BAD_ARG, "expect key value pairs");
+    }
+    thread_local vector<Blob *> blobs;
+    blobs.clear();
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        blobs.push_back(val_blob(cmd[i]));
+    }
+    KeyBatch &b = batch_begin(cmd, 1, 2);
+    for (uint32_t i : b.order) {
+        LookupKey &key = b.keys[i];
+        set_locked(shard_for(key.node.hCode), key, cmd[2 + 2 * i], blobs[i]);
+    }
+    propagate(cmd);
+    batch_end(b);
+    return out_nil(out);
+}
+
+// mdel key...: the number of keys deleted.
+static void do_mdel(vector<string_view> &cmd, OutBuf &out) {
+    KeyBatch &b = batch_begin(cmd, 1, 1);
+    int64_t ndeleted = 0;
+    for (uint32_t i : b.order) {
+        LookupKey &key = b.keys[i];
+        Shard *sh = shard_for(key.node.hCode);
+        // an expired key counts as gone already.
+        if (entry_lookup(sh, key)) {
+            HashNode *node = hmap_delete(&sh->hmap, &key.node, entry_eq);
+            entry_free(sh, container_of(node, Entry, node));
+            ndeleted++;
+        }
+    }
+    if (ndeleted) {
+        propagate(cmd);
+    }
+    batch_end(b);
+    return out_int(out, ndeleted);
+}
+
+// zadd key score name
+static void do_zadd(vector<string_view> &cmd, OutBuf &out) {
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+
+    ZSet *zset = nullptr;
+    if (!lookup_zset(sh, key, out, zset)) {
+        return;
+    }
+    if (!zset) {
+        zset = new ZSet();
+        Entry *ent = entry_new(sh, key.key, key.node.hCode, sizeof(zset));
+        entry_set_zset(sh, ent, zset);
+        shard_insert(sh, ent);
+    }
+    size_t old_mem = zset_mem(zset);
+    bool added = zset_insert(zset, cmd[3].data(), cmd[3].size(), score);
+    entry_zset_resized(sh, zset, old_mem);
+    propagate(cmd);
+    return out_int(out, (int64_t)added);
+}
+
+// zrem key name
+static void do_zrem(vector<string_view> &cmd, OutBuf &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+
+    ZSet *zset = nullptr;
+    if (!lookup_zset(sh, key, out, zset)) {
+        return;
+    }
+    ZNode *znode = zset ? zset_lookup(zset, cmd[2].data(), cmd[2].size()) : nullptr;
+    if (!znode) {
+        return out_int(out, 0);
+    }
+    size_t old_mem = zset_mem(zset);
+    zset_delete(zset, znode);
+    entry_zset_resized(sh, zset, old_mem);
+    if (zset_size(zset) == 0) {
+        // as in redis, an empty set does not stay around as a key.
+        HashNode *node = hmap_delete(&sh->hmap, &key.node, entry_eq);
+        entry_free(sh, container_of(node, Entry, node));
+    }
+    propagate(cmd);
+    return out_int(out, 1);
+}
+
+// zscore key name
+static void do_zscore(vector<string_view> &cmd, OutBuf &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+
+    ZSet *zset = nullptr;
+    if (!lookup_zset(sh, key, out, zset)) {
+        return;
+    }
+    ZNode *znode = zset ? zset_lookup(zset, cmd[2].data(), cmd[2].size()) : nullptr;
+    return znode ? out_dbl(out, znode->score) : out_nil(out);
+}
+
+// zrank key name: 0-based position in (score, name) order.
+static void do_zrank(vector<string_view> &cmd, OutBuf &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+
+    ZSet *zset = nullptr;
+    if (!lookup_zset(sh, key, out, zset)) {
+        return;
+    }
+    ZNode *znode = zset ? zset_lookup(zset, cmd[2].data(), cmd[2].size()) : nullptr;
+    return znode ? out_int(out, zset_rank(znode)) : out_nil(out);
+}
+
+// zrange key score name offset limit
+// up to `limit` members from the first one >= (score, name), skipping
+// `offset` of them, as a flat [name, score, name, score...] array.
+static void do_zrange(vector<string_view> &cmd, OutBuf &out) {
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    int64_t offset = 0, limit = 0;
+    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+
+    ZSet *zset = nullptr;
+    if (!lookup_zset(sh, key, out, zset)) {
+        return;
+    }
+    ZNode *znode = nullptr;
+    if (zset && limit > 0) {
+        znode = zset_seekge(zset, score, cmd[3].data(), cmd[3].size());
+        znode = znode_offset(znode, offset);
+    }
+    // the ranks tell how many members follow, so the count is known upfront.
+    int64_t n = 0;
+    if (znode) {
+        n = min<int64_t>(limit, (int64_t)zset_size(zset) - zset_rank(znode));
+    }
+    out_array_header(out, (uint32_t)(n * 2));
+    for (int64_t i = 0; i < n; i++) {
+        out_str(out, znode->name, znode->len);
+        out_dbl(out, znode->score);
+        znode = znode_offset(znode, 1);
+    }
+}
+
+
+// glob-style: `*`, `?`, `[abc]`, `[a-z]`, `[^a]` and `\\` to escape.
+static bool glob_match(string_view pat, string_view str) {
+    size_t p = 0, i = 0;
+    size_t star_p = string_view::npos, star_i = 0; // last `*`, for backtracking.
+    while (i < str.size()) {
+        if (p < pat.size() && pat[p] == '*') {
+            star_p = p++;
+            star_i = i;
+            continue;
+        }
+        if (p < pat.size()) {
+            bool ok = false;
+            size_t next = p + 1;
+            if (pat[p] == '?') {
+                ok = true;
+            } else if (pat[p] == '[') {
+                size_t j = p + 1;
+                bool negate = j < pat.size() && (pat[j] == '^' || pat[j] == '!');
+                j += negate;
+                bool hit = false;
+                for (bool first = true; j < pat.size() && (first || pat[j] != ']'); first = false) {
+                    if (pat[j] == '\\' && j + 1 < pat.size()) {
+                        j++;
+                    }
+                    char lo = pat[j], hi = pat[j];
+                    if (j + 2 < pat.size() && pat[j + 1] == '-' && pat[j + 2] != ']') {
+                        hi = pat[j + 2];
+                        j += 2;
+                    }
+                    hit |= (lo <= str[i] && str[i] <= hi) || (hi <= str[i] && str[i] <= lo);
+                    j++;
+                }
+                ok = hit != negate;
+                next = j < pat.size() ? j + 1 : j; // past the `]`.
+            } else {
+                if (pat[p] == '\\' && p + 1 < pat.size()) {
+                    next = ++p + 1;
+                }
+                ok = pat[p] == str[i];
+            }
+            if (ok) {
+                p = next;
+                i++;
+                continue;
+            }
+        }
+        if (star_p == string_view::npos) {
+            return false;
+        }
+        p = star_p + 1; // let the last `*` take one more byte.
+        i = ++star_i;
+    }
+    while (p < pat.size() && pat[p] == '*') {
+        p++;
+    }
+    return p == pat.size();
+}
+
+struct ScanCtx {
+    OutBuf *out = nullptr;
+    Shard *sh = nullptr;
+    string_view pattern;
+    bool match_all = true;
+    uint64_t now = 0;
+    uint32_t nkeys = 0;
+};
+
+static void cb_scan(HashNode *node, void *arg) {
+    ScanCtx *ctx = (ScanCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->ttl_idx != k_heap_none && ctx->sh->ttl_heap[ent->ttl_idx].val <= ctx->now) {
+        return; // expired, not deleted yet.
+    }
+    string_view key = entry_key(ent);
+    if (!ctx->match_all && !glob_match(ctx->pattern, key)) {
+        return;
+    }
+    out_str(*ctx->out, key.data(), key.size());
+    ctx->nkeys++;
+}
+
+// the cursor's low bits are the shard, the rest is the shard's hmap_scan()
+// cursor, which stays far below 2^58.
+const size_t k_shard_bits = 6;
+static_assert(k_nshards == 1 << k_shard_bits, "");
+
+// scan cursor [match pattern] [count n] -> [next cursor, [keys...]]
+// incremental replacement for keys: each call visits about `count` keys,
+// one shard lock at a time. keys present during the whole scan are returned
+// at least once (maybe more), until the cursor comes back as 0.
+// a larger COUNT is taken as this one, it is only a hint anyway.
+const int64_t k_scan_max_count = 1 << 20;
+
+static void do_scan(vector<string_view> &cmd, OutBuf &out) {
+    int64_t cursor = 0, count = 10;
+    ScanCtx ctx;
+    bool ok = cmd.size() % 2 == 0 && str2int(cmd[1], cursor) && cursor >= 0;
+    for (size_t i = 2; ok && i < cmd.size(); i += 2) {
+        if (cmd[i] == "match") {
+            ctx.pattern = cmd[i + 1];
+            ctx.match_all = ctx.pattern == "*";
+        } else if (cmd[i] == "count") {
+            ok = str2int(cmd[i + 1], count) && count > 0;
+            count = min<int64_t>(count, k_scan_max_count); // count * 10 must not overflow.
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        return out_err(out, ERR_BAD_ARG, "usage: scan cursor [match pattern] [count n]");
+    }
+
+    size_t shard = (uint64_t)cursor & (k_nshards - 1);
+    size_t pos = (uint64_t)cursor >> k_shard_bits;
+    out_array_header(out, 2);
+    // the next cursor goes first, so it is patched in like the count.
+    append_to_buffer_u8(out, TAG_INT);
+    size_t cursor_ctx = buf_len(&out.bytes);
+    append_to_buffer_u64(out, 0);
+    size_t arr_ctx = out_begin_arr(out);
+
+    ctx.out = &out;
+    ctx.now = get_monotonic_msec();
+    // a step may find nothing (an empty bucket, or no match), so the number
+    // of steps is bounded too.
+    for (int64_t steps = 0; shard < k_nshards && ctx.nkeys < count && steps < count * 10; steps++) {
+        ctx.sh = &g_db.shards[shard];
+        std::lock_guard<std::mutex> lock(ctx.sh->mu);
+        pos = hmap_scan(&ctx.sh->hmap, pos, cb_scan, &ctx);
+        if (pos == 0) {
+            shard++;
+        }
+    }
+    uint64_t next = shard < k_nshards ? (pos << k_shard_bits) | shard : 0;
+    memcpy(buf_data(&out.bytes) + cursor_ctx, &next, 8);
+    out_end_arr(out, arr_ctx, ctx.nkeys);
+}
+
+// sets the deadline of cmd[1] to `at_ms`, in unix time: 1 if the key
+// exists. a deadline that already passed deletes the key. logged as
+// pexpireat, so replaying it later does not extend the TTL.
+static void expire_at(vector<string_view> &cmd, OutBuf &out, int64_t at_ms, uint64_t now_real) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+
+    Entry *ent = entry_lookup(sh, key);
+    if (!ent) {
+        return out_int(out, 0);
+    }
+    if (at_ms <= (int64_t)now_real && !g_loading && !t_replicating) {
+        hmap_delete(&sh->hmap, &key.node, entry_eq);
+        entry_free(sh, ent);
+        string_view del[2] = {"del", cmd[1]};
+        propagate(del, 2);
+    } else {
+        // a replayed deadline may have passed since, but a later command
+        // in the log (persist, set) can still keep the key.
+        uint64_t now = get_monotonic_msec();
+        entry_set_ttl(sh, ent, at_ms > (int64_t)now_real ? now + (uint64_t)at_ms - now_real : 0);
+        char at[32];
+        int len = snprintf(at, sizeof(at), "%lld", (long long)at_ms);
+        string_view log[3] = {"pexpireat", cmd[1], string_view(at, len)};
+        propagate(log, 3);
+    }
+    return out_int(out, 1);
+}
+
+// pexpire key ms / expire key seconds.
+static void expire_in(vector<string_view> &cmd, OutBuf &out, int64_t unit_ms) {
+    int64_t ttl = 0;
+    if (!str2int(cmd[2], ttl)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    uint64_t now = get_realtime_msec();
+    int64_t at_ms = 0;
+    if (ttl > 0) {
+        int64_t max_ttl = (INT64_MAX - (int64_t)now) / unit_ms;
+        at_ms = (int64_t)now + (ttl > max_ttl ? max_ttl : ttl) * unit_ms;
+    }
+    return expire_at(cmd, out, at_ms, now);
+}
+
+static void do_expire(vector<string_view> &cmd, OutBuf &out) { expire_in(cmd, out, 1000); }
+static void do_pexpire(vector<string_view> &cmd, OutBuf &out) { expire_in(cmd, out, 1); }
+
+// pexpireat key unix-ms
+static void do_pexpireat(vector<string_view> &cmd, OutBuf &out) {
+    int64_t at_ms = 0;
+    if (!str2int(cmd[2], at_ms)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    return expire_at(cmd, out, at_ms, get_realtime_msec());
+}
+
+// ttl key: seconds left, -1 without a TTL, -2 if the key does not exist.
+static void do_ttl(vector<string_view> &cmd, OutBuf &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+
+    Entry *ent = entry_lookup(sh, key);
+    if (!ent) {
+        return out_int(out, -2);
+    }
+    if (ent->ttl_idx == k_heap_none) {
+        return out_int(out, -1);
+    }
+    uint64_t deadline = sh->ttl_heap[ent->ttl_idx].val;
+    uint64_t now = get_monotonic_msec();
+    // the deadline may pass between the lookup and this read.
+    return out_int(out, deadline > now ? (int64_t)((deadline - now + 999) / 1000) : 0); // round up.
+}
+
+// persist key: 1 if a TTL was removed.
+static void do_persist(vector<string_view> &cmd, OutBuf &out) {
+    LookupKey key;
+    lookup_key_init(key, cmd[1]);
+    Shard *sh = shard_for(key.node.hCode);
+    std::lock_guard<std::mutex> lock(sh->mu);
+
+    Entry *ent = entry_lookup(sh, key);
+    if (!ent || ent->ttl_idx == k_heap_none) {
+        return out_int(out, 0);
+    }
+    entry_set_ttl(sh, ent, UINT64_MAX);
+    propagate(cmd);
+    return out_int(out, 1);
+}
+
+// ---- snapshot ----
+// file layout, little-endian:
+//   [8B magic "LOOPDB01"][8B key count, a sizing hint]
+//   records: [4B len][1B type][8B deadline, unix ms, 0 = none][4B klen][key]
+//            followed by the value (T_STR), or by [4B n] and n members
+//            [8B score][4B len][name] (T_ZSET). `len` counts from `type`.
+//   [4B CRC-32C of everything before]
+
+static const char k_dump_magic[8] = {'L', 'O', 'O', 'P', 'D', 'B', '0', '1'};
+const size_t k_dump_buf = 1 << 20;
+
+struct DumpWriter {
+    int fd = -1;
+    vector<uint8_t> buf;
+    uint32_t crc = 0;
+    bool ok = true;
+};
+
+static void dump_flush(DumpWriter &w) {
+    w.crc = crc32c(w.crc, w.buf.data(), w.buf.size());
+    for (size_t off = 0; w.ok && off < w.buf.size();) {
+        ssize_t rv = write(w.fd, w.buf.data() + off, w.buf.size() - off);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        w.ok = rv > 0;
+        off += rv > 0 ? rv : 0;
+    }
+    w.buf.clear();
+}
+
+static void dump_put(DumpWriter &w, const void *data, size_t len) {
+    w.buf.insert(w.buf.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+}
+
+static void dump_put_u32(DumpWriter &w, uint32_t v) { dump_put(w, &v, 4); }
+static void dump_put_u64(DumpWriter &w, uint64_t v) { dump_put(w, &v, 8); }
+
+struct DumpCtx {
+    DumpWriter *w = nullptr;
+    Shard *sh = nullptr;
+    uint64_t now_mono = 0;
+    uint64_t now_real = 0;
+};
+
+static bool cb_dump(HashNode *node, void *arg) {
+    DumpCtx *ctx = (DumpCtx *)arg;
+    DumpWriter &w = *ctx->w;
+    Entry *ent = container_of(node, Entry, node);
+    uint64_t deadline = 0;
+    if (ent->ttl_idx != k_heap_none) {
+        uint64_t mono = ctx->sh->ttl_heap[ent->ttl_idx].val;
+        if (mono <= ctx->now_mono) {
+            return true; // expired, not deleted yet.
+        }
+        deadline = ctx->now_real + (mono - ctx->now_mono);
+    }
+
+    size_t start = w.buf.size();
+    dump_put_u32(w, 0); // patched below, records never straddle a flush.
+    w.buf.push_back(ent->type);
+    dump_put_u64(w, deadline);
+    dump_put_u32(w, ent->klen);
+    dump_put(w, ent->data, ent->klen);
+    if (ZSet *zset = entry_zset(ent)) {
+        dump_put_u32(w, (uint32_t)zset_size(zset));
+        for (ZNode *znode = znode_offset(zset_seekge(zset, -INFINITY, "", 0), 0);
+             znode; znode = znode_offset(znode, 1)) {
+            dump_put(w, &znode->score, 8);
+            dump_put_u32(w, (uint32_t)znode->len);
+            dump_put(w, znode->name, znode->len);
+        }
+    } else if (Blob *blob = entry_blob(ent)) {
+        dump_put(w, blob->data, blob->len);
+    } else if (ent->flags & ENT_INT) {
+        char buf[24];
+        string_view val = int_format(entry_int(ent), buf);
+        dump_put(w, val.data(), val.size()); // the file holds the text.
+    } else {
+        dump_put(w, ent->data + ent->klen, ent->vlen);
+    }
+    uint32_t len = (uint32_t)(w.buf.size() - start - 4);
+    memcpy(w.buf.data() + start, &len, 4);
+
+    if (w.buf.size() >= k_dump_buf) {
+        dump_flush(w);
+    }
+    return w.ok;
+}
+
+// writes the whole keyspace to `path`, through a temporary file renamed
+// into place, so a crash never leaves a half-written snapshot. the caller
+// holds every shard lock, or is the forked child that nobody else touches.
+static bool dump_keyspace(const char *path) {
+    string tmp = string(path) + ".tmp";
+    DumpWriter w;
+    w.fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w.fd < 0) {
+        return false;
+    }
+    w.buf.reserve(k_dump_buf * 2);
+    uint64_t nkeys = 0;
+    for (Shard &sh : g_db.shards) {
+        nkeys += hmap_size(&sh.hmap);
+    }
+    dump_put(w, k_dump_magic, sizeof(k_dump_magic));
+    dump_put_u64(w, nkeys);
+
+    DumpCtx ctx;
+    ctx.w = &w;
+    ctx.now_mono = get_monotonic_msec();
+    ctx.now_real = get_realtime_msec();
+    for (Shard &sh : g_db.shards) {
+        ctx.sh = &sh;
+        hmap_for_each_key(&sh.hmap, cb_dump, &ctx);
+    }
+    dump_flush(w);
+    uint32_t crc = w.crc;
+    dump_put_u32(w, crc);
+    dump_flush(w);
+
+    bool ok = w.ok && fsync(w.fd) == 0;
+    ok = close(w.fd) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path) == 0;
+    if (!ok) {
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+static bool cb_rewrite(HashNode *node, void *arg) {
+    DumpCtx *ctx = (DumpCtx *)arg;
+    DumpWriter &w = *ctx->w;
+    Entry *ent = container_of(node, Entry, node);
+    string_view key = entry_key(ent);
+    if (ent->ttl_idx != k_heap_none && ctx->sh->ttl_heap[ent->ttl_idx].val <= ctx->now_mono) {
+        return true;
+    }
+    if (ZSet *zset = entry_zset(ent)) {
+        char score[32];
+        for (ZNode *znode = znode_offset(zset_seekge(zset, -INFINITY, "", 0), 0);
+             znode; znode = znode_offset(znode, 1)) {
+            int len = snprintf(score, sizeof(score), "%.17g", znode->score);
+            string_view args[4] = {"zadd", key, string_view(score, len),
+                                   string_view(znode->name, znode->len)};
+            aof_encode(w.buf, args, 4);
+        }
+    } else {
+        Blob *blob = entry_blob(ent);
+        char buf[24];
+        string_view val = blob ? string_view(blob->data, blob->len)
+                        : (ent->flags & ENT_INT) ? int_format(entry_int(ent), buf)
+                        : string_view(ent->data + ent->klen, ent->vlen);
+        string_view args[3] = {"set", key, val};
+        aof_encode(w.buf, args, 3);
+    }
+    if (ent->ttl_idx != k_heap_none) {
+        uint64_t mono = ctx->sh->ttl_heap[ent->ttl_idx].val;
+        char at[32];
+        int len = snprintf(at, sizeof(at), "%llu",
+                           (unsigned long long)(ctx->now_real + (mono - ctx->now_mono)));
+        string_view args[3] = {"pexpireat", key, string_view(at, len)};
+        aof_encode(w.buf, args, 3);
+    }
+    if (w.buf.size() >= k_dump_buf) {
+        dump_flush(w);
+    }
+    return w.ok;
+}
+
+// the shortest command log that rebuilds the keyspace: one set or one zadd
+// per member, and a pexpireat for keys with a TTL. same locking as
+// dump_keyspace(), the caller renames the file into place.
+static bool rewrite_keyspace(const char *path) {
+    DumpWriter w;
+    w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w.fd < 0) {
+        return false;
+    }
+    w.buf.reserve(k_dump_buf * 2);
+    DumpCtx ctx;
+    ctx.w = &w;
+    ctx.now_mono = get_monotonic_msec();
+    ctx.now_real = get_realtime_msec();
+    for (Shard &sh : g_db.shards) {
+        ctx.sh = &sh;
+        hmap_for_each_key(&sh.hmap, cb_rewrite, &ctx);
+    }
+    dump_flush(w);
+    bool ok = w.ok && fsync(w.fd) == 0;
+    return close(w.fd) == 0 && ok;
+}
+
+enum {
+    CHILD_SNAPSHOT = 0,
+    CHILD_AOF_REWRITE = 1,
+    CHILD_REPL_SNAPSHOT = 2, // for the replicas' full resyncs.
+};
+
+enum {
+    REPL_SNAP_PENDING = 0,
+    REPL_SNAP_OK = 1,
+    REPL_SNAP_FAILED = 2,
+};
+
+// a snapshot sent to replicas: the ones that sync while it is being made,
+// or while the backlog still goes back to its offset, share it.
+struct ReplSnapshot {
+    int state = REPL_SNAP_PENDING; // under g_save.mu.
+    uint64_t offset = 0;           // the stream position it was taken at.
+    int file = -1;                 // unlinked, open until the last sender is done.
+    off_t size = 0;
+
+    ~ReplSnapshot() {
+        if (file >= 0) {
+            close(file);
+        }
+    }
+};
+
+// at most one forked child at a time, writing a snapshot or a new log.
+static struct {
+    std::mutex mu; // serializes save, forking and reaping the child.
+    std::atomic<pid_t> child{0};
+    int kind = CHILD_SNAPSHOT;
+    std::shared_ptr<ReplSnapshot> repl; // the latest replica snapshot.
+    std::atomic<bool> rewrite_pending{false}; // the log misses a full resync.
+    std::atomic<uint64_t> rewrite_failed_ms{0}; // monotonic, 0: the last one did not fail.
+    bool last_ok = true;
+    uint64_t last_save_ms = 0; // realtime
+} g_save;
+
+// the log grows until it is twice its size after the last rewrite, but a
+// rewrite is not worth forking for below this.
+const uint64_t k_aof_rewrite_min = 64 << 20;
+// after a failed rewrite (disk full, say), the next automatic one waits
+// this long instead of forking again on the next loop turn.
+const uint64_t k_aof_rewrite_retry_ms = 5000;
+
+static string aof_rewrite_path() {
+    return string(g_config.aof_file) + ".rewrite";
+}
+
+static string repl_snapshot_path() {
+    return string(g_config.dbfile) + ".repl";
+}
+
+static void lock_all_shards() {
+    for (Shard &sh : g_db.shards) {
+        sh.mu.lock(); // always in the same order.
+    }
+}
+
+static void unlock_all_shards() {
+    for (Shard &sh : g_db.shards) {
+        sh.mu.unlock();
+    }
+}
+
+// with g_save.mu held.
+static void child_reap_locked() {
+    pid_t child = g_save.child.load();
+    int status = 0;
+    if (!child || waitpid(child, &status, WNOHANG) != child) {
+        return;
+    }
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (g_save.kind == CHILD_AOF_REWRITE) {
+        ok = aof_rewrite_end(aof_rewrite_path().c_str(), ok);
+        g_save.rewrite_failed_ms = ok ? 0 : get_monotonic_msec();
+        fprintf(stderr, "background aof rewrite %s\n", ok ? "done" : "failed");
+    } else if (g_save.kind == CHILD_REPL_SNAPSHOT) {
+        ReplSnapshot *snap = g_save.repl.get();
+        string path = repl_snapshot_path();
+        snap->file = ok ? open(path.c_str(), O_RDONLY) : -1;
+        unlink(path.c_str()); // readable through `file` until it is closed.
+        struct stat st;
+        ok = snap->file >= 0 && fstat(snap->file, &st) == 0;
+        snap->size = ok ? st.st_size : 0;
+        snap->state = ok ? REPL_SNAP_OK : REPL_SNAP_FAILED;
+        fprintf(stderr, "replica snapshot %s\n", ok ? "done" : "failed");
+    } else {
+        g_save.last_ok = ok;
+        g_save.last_save_ms = get_realtime_msec();
+        fprintf(stderr, "background save %s\n", ok ? "done" : "failed");
+    }
+    g_save.child = 0;
+}
+
+// the forked child writes from its copy-on-write view of the keyspace while
+// the parent keeps serving. every shard is locked across fork(), so the
+// child's view is one point in time and no shard is caught halfway through
+// a command. with g_save.mu held and no child running.
+static pid_t child_fork_locked(int kind) {
+    lock_all_shards();
+    if (kind == CHILD_REPL_SNAPSHOT) {
+        // the replicas continue from the backlog at this very point.
+        repl_backlog_start(g_config.repl_backlog);
+        g_save.repl->offset = repl_offset();
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // only this thread exists in the child, the locks are never taken.
+        bool ok = kind == CHILD_AOF_REWRITE ? rewrite_keyspace(aof_rewrite_path().c_str())
+                : kind == CHILD_REPL_SNAPSHOT ? dump_keyspace(repl_snapshot_path().c_str())
+                : dump_keyspace(g_config.dbfile);
+        _exit(ok ? 0 : 1);
+    }
+    if (pid > 0 && kind == CHILD_AOF_REWRITE) {
+        aof_rewrite_begin(); // no command can run until the unlock.
+        g_save.rewrite_pending = false;
+    }
+    unlock_all_shards();
+    if (pid > 0) {
+        g_save.kind = kind;
+        g_save.child = pid;
+    }
+    return pid;
+}
+
+static bool aof_wants_rewrite() {
+    if (!aof_enabled()) {
+        return false;
+    }
+    uint64_t failed = g_save.rewrite_failed_ms.load(std::memory_order_relaxed);
+    if (failed && get_monotonic_msec() < failed + k_aof_rewrite_retry_ms) {
+        return false;
+    }
+    return g_save.rewrite_pending.load(std::memory_order_relaxed)
+        || (aof_size() >= k_aof_rewrite_min && aof_size() >= 2 * aof_base_size());
+}
+
+// called every loop turn, cheap unless a child is running or the log grew.
+static void child_poll() {
+    if (!g_save.child.load(std::memory_order_relaxed) && !aof_wants_rewrite()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(g_save.mu, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    child_reap_locked(); // may have just rewritten the log.
+    if (!g_save.child && aof_wants_rewrite()) {
+        fprintf(stderr, "aof at %llu bytes, rewriting\n", (unsigned long long)aof_size());
+        if (child_fork_locked(CHILD_AOF_REWRITE) < 0) {
+            g_save.rewrite_failed_ms = get_monotonic_msec();
+        }
+    }
+}
+
+// save: writes the snapshot now, every client waits meanwhile.
+static void do_save(vector<string_view> &, OutBuf &out) {
+    std::lock_guard<std::mutex> lock(g_save.mu);
+    child_reap_locked();
+    if (g_save.child) {
+        return out_err(out, ERR_BAD_ARG, "background save in progress");
+    }
+    lock_all_shards();
+    g_save.last_ok = dump_keyspace(g_config.dbfile);
+    unlock_all_shards();
+    g_save.last_save_ms = get_realtime_msec();
+    if (!g_save.last_ok) {
+        return out_err(out, ERR_UNKNOWN, strerror(errno));
+    }
+    return out_nil(out);
+}
+
+// bgsave / bgrewriteaof
+static void start_child(OutBuf &out, int kind) {
+    if (kind == CHILD_AOF_REWRITE && !aof_enabled()) {
+        return out_err(out, ERR_BAD_ARG, "aof is off");
+    }
+    std::lock_guard<std::mutex> lock(g_save.mu);
+    child_reap_locked();
+    if (g_save.child) {
+        return out_err(out, ERR_BAD_ARG, "background save in progress");
+    }
+    if (child_fork_locked(kind) < 0) {
+        return out_err(out, ERR_UNKNOWN, strerror(errno));
+    }
+    return out_nil(out);
+}
+
+static void do_bgsave(vector<string_view> &, OutBuf &out) { start_child(out, CHILD_SNAPSHOT); }
+static void do_bgrewriteaof(vector<string_view> &, OutBuf &out) { start_child(out, CHILD_AOF_REWRITE); }
+
+// sizes the empty tables for `nkeys` keys before loading them.
+static void reserve_shards(uint64_t nkeys) {
+    // keys spread evenly over the shards by hash, leave room for the noise.
+    double per_shard = (double)nkeys / k_nshards;
+    for (Shard &sh : g_db.shards) {
+        hmap_reserve(&sh.hmap, (size_t)(per_shard + 4 * sqrt(per_shard)) + 16);
+    }
+}
+
+struct DumpReader {
+    const uint8_t *curr = nullptr;
+    const uint8_t *end = nullptr;
+};
+
+static bool load_u32(DumpReader &r, uint32_t &v) {
+    return read_u32(r.curr, r.end, v) == 0;
+}
+
+static bool load_u64(DumpReader &r, uint64_t &v) {
+    if (r.curr + 8 > r.end) {
+        return false;
+    }
+    memcpy(&v, r.curr, 8);
+    r.curr += 8;
+    return true;
+}
+
+static bool load_str(DumpReader &r, size_t n, string_view &out) {
+    return read_str(r.curr, r.end, n, out) == 0;
+}
+
+static bool load_record(DumpReader &r, uint64_t now_mono, uint64_t now_real) {
+    uint8_t type = *r.curr++;
+    uint64_t deadline = 0;
+    uint32_t klen = 0;
+    string_view key;
+    if (!load_u64(r, deadline) || !load_u32(r, klen) || !load_str(r, klen, key)) {
+        return false;
+    }
+    if (deadline && deadline <= now_real) {
+        r.curr = r.end; // expired while the server was down.
+        return true;
+    }
+    LookupKey lk;
+    lookup_key_init(lk, key);
+    Shard *sh = shard_for(lk.node.hCode);
+
+    Entry *ent = nullptr;
+    if (type == T_STR) {
+        string_view val((const char *)r.curr, r.end - r.curr);
+        r.curr = r.end;
+        Blob *blob = val.size() >= k_out_ref_min ? blob_new(val.data(), val.size()) : nullptr;
+        ent = entry_new(sh, key, lk.node.hCode, entry_vlen(val, blob));
+        entry_set_val(sh, ent, val.data(), val.size(), blob);
+    } else if (type == T_ZSET) {
+        uint32_t n = 0;
+        if (!load_u32(r, n)) {
+            return false;
+        }
+        ZSet *zset = new ZSet();
+        hmap_reserve(&zset->hmap, n);
+        ent = entry_new(sh, key, lk.node.hCode, sizeof(zset));
+        entry_set_zset(sh, ent, zset);
+        size_t old_mem = zset_mem(zset);
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t bits = 0;
+            uint32_t nlen = 0;
+            string_view name;
+            if (!load_u64(r, bits) || !load_u32(r, nlen) || !load_str(r, nlen, name)) {
+                entry_free(sh, ent);
+                garbage_release(false);
+                return false;
+            }
+            double score = 0;
+            memcpy(&score, &bits, 8);
+            zset_insert(zset, name.data(), name.size(), score);
+        }
+        entry_zset_resized(sh, zset, old_mem);
+    } else {
+        return false;
+    }
+    shard_insert(sh, ent);
+    if (deadline) {
+        entry_set_ttl(sh, ent, now_mono + (deadline - now_real));
+    }
+    return r.curr == r.end;
+}
+
+// at startup, before the workers run. a missing file is an empty store, a
+// damaged one is fatal rather than silently serving partial data.
+static const char *load_snapshot(const uint8_t *data, size_t size, size_t &nrecords) {
+    const size_t min_size = sizeof(k_dump_magic) + 8 + 4;
+    if (size < min_size) {
+        return "snapshot is truncated";
+    }
+    uint32_t crc = 0;
+    memcpy(&crc, data + size - 4, 4);
+    if (memcmp(data, k_dump_magic, sizeof(k_dump_magic)) != 0
+        || crc32c(0, data, size - 4) != crc) {
+        return "snapshot is corrupt (bad magic or checksum)";
+    }
+
+    uint64_t nkeys = 0;
+    memcpy(&nkeys, data + sizeof(k_dump_magic), 8);
+    reserve_shards(nkeys);
+
+    DumpReader r;
+    r.curr = data + sizeof(k_dump_magic) + 8;
+    const uint8_t *end = data + size - 4;
+    uint64_t now_mono = get_monotonic_msec();
+    uint64_t now_real = get_realtime_msec();
+    nrecords = 0;
+    while (r.curr < end) {
+        uint32_t len = 0;
+        DumpReader rec;
+        rec.curr = r.curr + 4;
+        if (r.curr + 4 > end || (memcpy(&len, r.curr, 4), len == 0)
+            || rec.curr + len > end) {
+            return "snapshot has a malformed record";
+        }
+        rec.end = rec.curr + len;
+        if (!load_record(rec, now_mono, now_real)) {
+            return "snapshot has a malformed record";
+        }
+        r.curr = rec.end;
+        nrecords++;
+    }
+    return nullptr;
+}
+
+// load_snapshot() from the mapped file, into the keyspace as it is.
+static const char *load_snapshot_file(const char *path, size_t &nrecords) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return "open() snapshot failed";
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return "fstat() failed";
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return "snapshot is truncated";
+    }
+    void *mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return "mmap() failed";
+    }
+    madvise(mem, size, MADV_SEQUENTIAL);
+    const char *err = load_snapshot((const uint8_t *)mem, size, nrecords);
+    munmap(mem, size);
+    return err;
+}
+
+static void load_keyspace(const char *path) {
+    if (access(path, F_OK) < 0 && errno == ENOENT) {
+        return;
+    }
+    uint64_t t0 = get_monotonic_msec();
+    size_t nrecords = 0;
+    if (const char *err = load_snapshot_file(path, nrecords)) {
+        die(err);
+    }
+    fprintf(stderr, "loaded %zu records from %s in %llu ms\n", nrecords, path,
+            (unsigned long long)(get_monotonic_msec() - t0));
+}
+
+static void do_command(vector<string_view> &cmd,  OutBuf &out);
+
+// runs the logged commands through do_command(), straight from the mapped
+// file. a record cut short by a crash is dropped with the file's tail,
+// anything else that does not parse is fatal.
+static void replay_aof(const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        die("open() aof failed");
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        die("fstat() failed");
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return;
+    }
+    uint64_t t0 = get_monotonic_msec();
+    void *mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (mem == MAP_FAILED) {
+        die("mmap() failed");
+    }
+    madvise(mem, size, MADV_SEQUENTIAL);
+    const uint8_t *data = (const uint8_t *)mem;
+
+    // a first pass only hops over the records. a rewritten log holds about
+    // one record per key, so their number sizes the tables well enough.
+    size_t nrecords = 0;
+    for (size_t pos = 0; pos + 4 <= size; nrecords++) {
+        uint32_t len = 0;
+        memcpy(&len, data + pos, 4);
+        pos += 4 + len;
+    }
+    reserve_shards(nrecords);
+
+    vector<string_view> cmd;
+    OutBuf out;
+    size_t pos = 0;
+    size_t ncmds = 0;
+    while (pos < size) {
+        uint32_t len = 0;
+        if (pos + 4 > size || (memcpy(&len, data + pos, 4), pos + 4 + len > size)) {
+            fprintf(stderr, "aof ends with a partial record, dropping %zu bytes\n", size - pos);
+            if (ftruncate(fd, pos) < 0) {
+                die("ftruncate() failed");
+            }
+            break;
+        }
+        if (parse_request(data + pos + 4, len, cmd) < 0) {
+            die("aof has a malformed record");
+        }
+        do_command(cmd, out);
+        out_truncate(&out, 0, 0);
+        garbage_release(false);
+        pos += 4 + len;
+        ncmds++;
+    }
+    munmap(mem, size);
+    close(fd);
+    fprintf(stderr, "replayed %zu commands from %s in %llu ms\n", ncmds, path,
+            (unsigned long long)(get_monotonic_msec() - t0));
+}
+
+// with the log on, it alone has the whole history and the snapshot is not
+// read, except to seed a log that does not exist yet.
+static void load_data() {
+    if (!g_config.aof_file) {
+        return load_keyspace(g_config.dbfile);
+    }
+    if (access(g_config.aof_file, F_OK) == 0) {
+        g_loading = true;
+        replay_aof(g_config.aof_file);
+        g_loading = false;
+    } else {
+        load_keyspace(g_config.dbfile);
+        string tmp = aof_rewrite_path();
+        if (!rewrite_keyspace(tmp.c_str()) || rename(tmp.c_str(), g_config.aof_file) < 0) {
+            die("cannot create the aof");
+        }
+    }
+    if (!aof_open(g_config.aof_file, g_config.appendfsync)) {
+        die("open() aof failed");
+    }
+}
+
+// ---- replication ----
+// a replica connects like any client and sends `sync <replid> <offset>`,
+// `?` and -1 the first time. the worker hands the socket to a sender
+// thread of its own, which does blocking I/O from then on and answers with
+// one of, in the request framing:
+//   continue <replid> <offset>
+//   fullresync <replid> <offset> <size>, followed by a snapshot of `size` bytes
+// and then streams the backlog from `offset`. the replica runs the stream
+// through do_command(), like the log replay does.
+
+const size_t k_repl_chunk = 256 * 1024;
+
+static bool send_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = send(fd, data, len, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+// send_all() for a file.
+static bool write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = write(fd, data, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+// the snapshot for a full resync: a recent one if the backlog still goes
+// back to its offset, the one being made, or a new one. it is forked like
+// bgsave, through g_save, so any number of syncs make one child at a time.
+// null while another child runs.
+static std::shared_ptr<ReplSnapshot> repl_snapshot_locked() {
+    child_reap_locked();
+    std::shared_ptr<ReplSnapshot> snap = g_save.repl;
+    vector<uint8_t> none;
+    if (snap && (snap->state == REPL_SNAP_PENDING
+                 || (snap->state == REPL_SNAP_OK && repl_backlog_read(snap->offset, none, 0)))) {
+        return snap;
+    }
+    if (g_save.child) {
+        return nullptr;
+    }
+    g_save.repl = snap = std::make_shared<ReplSnapshot>();
+    if (child_fork_locked(CHILD_REPL_SNAPSHOT) < 0) {
+        snap->state = REPL_SNAP_FAILED;
+    }
+    return snap;
+}
+
+// writes a snapshot to the replica, returns false if it could not.
+static bool repl_full_resync(int fd, uint64_t &from) {
+    std::shared_ptr<ReplSnapshot> snap;
+    int state = REPL_SNAP_PENDING;
+    while (state == REPL_SNAP_PENDING) {
+        {
+            std::lock_guard<std::mutex> lock(g_save.mu);
+            if (!snap) {
+                snap = repl_snapshot_locked();
+            } else {
+                child_reap_locked(); // the workers may not get to it first.
+            }
+            state = snap ? snap->state : REPL_SNAP_PENDING;
+        }
+        if (state == REPL_SNAP_PENDING) {
+            usleep(10 * 1000);
+        }
+    }
+    if (state != REPL_SNAP_OK) {
+        return false;
+    }
+    from = snap->offset;
+    string offset = std::to_string(from);
+    string size = std::to_string(snap->size);
+    string_view args[4] = {"fullresync", repl_id(), offset, size};
+    vector<uint8_t> header;
+    aof_encode(header, args, 4);
+    bool ok = send_all(fd, header.data(), header.size());
+    for (off_t pos = 0; ok && pos < snap->size;) {
+        ok = sendfile(fd, snap->file, &pos, snap->size - pos) > 0; // its own position.
+    }
+    fprintf(stderr, "replica %d: full resync at %s, %s bytes\n", fd, offset.c_str(), size.c_str());
+    return ok;
+}
+
+// a replica that went away while nothing was sent to it.
+static bool repl_peer_closed(int fd) {
+    char c;
+    ssize_t rv = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return rv == 0 || (rv < 0 && errno != EAGAIN && errno != EINTR);
+}
+
+// sender threads, each with a replica. more syncs than this are refused.
+const int k_repl_max_senders = 16;
+static std::atomic<int> g_repl_senders{0};
+
+static void repl_serve(int fd, string replid, int64_t offset) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    vector<uint8_t> buf;
+    uint64_t from = (uint64_t)offset;
+    bool ok = true;
+    if (replid == repl_id() && offset >= 0 && repl_backlog_read(from, buf, 0)) {
+        string pos = std::to_string(from);
+        string_view args[3] = {"continue", repl_id(), pos};
+        aof_encode(buf, args, 3);
+        ok = send_all(fd, buf.data(), buf.size());
+        fprintf(stderr, "replica %d: partial resync from %s\n", fd, pos.c_str());
+    } else {
+        ok = repl_full_resync(fd, from);
+    }
+
+    while (ok) {
+        buf.clear();
+        if (!repl_backlog_read(from, buf, k_repl_chunk)) {
+            fprintf(stderr, "replica %d: fell behind the backlog\n", fd);
+            break;
+        }
+        if (buf.empty()) {
+            repl_wait(from, 1000);
+            ok = !repl_peer_closed(fd);
+            continue;
+        }
+        ok = send_all(fd, buf.data(), buf.size());
+        from += buf.size();
+    }
+    fprintf(stderr, "replica %d: disconnected\n", fd);
+    close(fd);
+    g_repl_senders.fetch_sub(1);
+}
+
+// the socket of a client that asked for sync now belongs to a sender thread.
+static void repl_attach(int fd, string_view replid, string_view offset) {
+    int64_t pos = -1;
+    if (!str2int(offset, pos)) {
+        pos = -1;
+    }
+    if (g_repl_senders.fetch_add(1) >= k_repl_max_senders) {
+        g_repl_senders.fetch_sub(1);
+        fprintf(stderr, "replica %d: refused, %d replicas already\n", fd, k_repl_max_senders);
+        close(fd);
+        return;
+    }
+    std::thread(repl_serve, fd, string(replid), pos).detach();
+}
+
+static bool cb_collect(HashNode *node, void *arg) {
+    ((vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+    return true;
+}
+
+// with every shard lock held.
+static void keyspace_clear_locked() {
+    vector<Entry *> ents;
+    for (Shard &sh : g_db.shards) {
+        ents.clear();
+        hmap_for_each_key(&sh.hmap, cb_collect, &ents);
+        hmap_clear(&sh.hmap);
+        for (Entry *ent : ents) {
+            entry_free(&sh, ent);
+        }
+        shard_sync_mem(&sh);
+    }
+}
+
+// the replica's position in the primary's stream, kept across reconnects.
+static struct {
+    string id = "?";
+    int64_t offset = -1;
+} g_replica;
+
+static int repl_connect() {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = nullptr;
+    string port = std::to_string(g_config.primary_port);
+    if (getaddrinfo(g_config.primary_host, port.c_str(), &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int val = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
+    }
+    return fd;
+}
+
+// reads until `in` has `want` bytes from `pos`.
+static bool repl_recv(int fd, vector<uint8_t> &in, size_t pos, size_t want) {
+    while (in.size() - pos < want) {
+        size_t old = in.size();
+        in.resize(old + max<size_t>(k_repl_chunk, want - (old - pos)));
+        ssize_t rv = recv(fd, in.data() + old, in.size() - old, 0);
+        in.resize(old + (rv > 0 ? rv : 0));
+        if (rv == 0 || (rv < 0 && errno != EINTR)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the `size` bytes of a snapshot, from `in` at `pos` and then the socket,
+// into a file: the replica holds the mapped file rather than a copy in
+// memory next to the keyspace it is loaded into. `in` keeps what follows.
+static bool repl_recv_file(int fd, vector<uint8_t> &in, size_t &pos, size_t size, const char *path) {
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        return false;
+    }
+    size_t n = min(size, in.size() - pos);
+    bool ok = write_all(file, in.data() + pos, n);
+    in.erase(in.begin(), in.begin() + pos + n);
+    pos = 0;
+    vector<uint8_t> chunk(k_repl_chunk);
+    for (size_t done = n; ok && done < size;) {
+        ssize_t rv = recv(fd, chunk.data(), min(chunk.size(), size - done), 0);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = rv > 0 && write_all(file, chunk.data(), (size_t)rv);
+        done += rv > 0 ? (size_t)rv : 0;
+    }
+    return close(file) == 0 && ok;
+}
+
+// the next request in the stream, the views point into `in`.
+static bool repl_next(int fd, vector<uint8_t> &in, size_t &pos, vector<string_view> &cmd) {
+    uint32_t len = 0;
+    if (!repl_recv(fd, in, pos, 4)) {
+        return false;
+    }
+    memcpy(&len, in.data() + pos, 4);
+    if (len > k_max_msg || !repl_recv(fd, in, pos, 4 + len)
+        || parse_request(in.data() + pos + 4, len, cmd) < 0) {
+        return false;
+    }
+    pos += 4 + len;
+    return true;
+}
+
+static void replica_session(int fd) {
+    string offset = std::to_string(g_replica.offset);
+    string_view args[3] = {"sync", g_replica.id, offset};
+    vector<uint8_t> in;
+    aof_encode(in, args, 3);
+    if (!send_all(fd, in.data(), in.size())) {
+        return;
+    }
+    in.clear();
+    size_t pos = 0;
+    vector<string_view> cmd;
+    int64_t from = 0;
+    if (!repl_next(fd, in, pos, cmd) || cmd.size() < 3 || !str2int(cmd[2], from)) {
+        return;
+    }
+    if (cmd.size() == 4 && cmd[0] == "fullresync") {
+        int64_t size = 0;
+        string id(cmd[1]);
+        string path = string(g_config.dbfile) + ".sync";
+        if (!str2int(cmd[3], size) || size < 0 || !repl_recv_file(fd, in, pos, size, path.c_str())) {
+            unlink(path.c_str());
+            return;
+        }
+        uint64_t t0 = get_monotonic_msec();
+        size_t nrecords = 0;
+        lock_all_shards(); // reads wait for the new data set.
+        keyspace_clear_locked();
+        const char *err = load_snapshot_file(path.c_str(), nrecords);
+        unlock_all_shards();
+        unlink(path.c_str());
+        garbage_release(true);
+        if (err) {
+            fprintf(stderr, "full resync failed: %s\n", err);
+            g_replica.id = "?";
+            return;
+        }
+        g_replica.id = id;
+        fprintf(stderr, "full resync: %zu records in %llu ms\n", nrecords,
+                (unsigned long long)(get_monotonic_msec() - t0));
+        if (aof_enabled()) {
+            g_save.rewrite_pending = true; // the log does not have the snapshot.
+        }
+    } else if (!(cmd[0] == "continue" && cmd[1] == g_replica.id && from == g_replica.offset)) {
+        return;
+    }
+    g_replica.offset = from;
+
+    OutBuf out;
+    while (true) {
+        size_t start = pos;
+        if (!repl_next(fd, in, pos, cmd)) {
+            break;
+        }
+        do_command(cmd, out);
+        out_truncate(&out, 0, 0);
+        garbage_release(true);
+        g_replica.offset += (int64_t)(pos - start);
+        // the views are used up, drop the consumed bytes now and then.
+        if (pos >= k_repl_chunk) {
+            in.erase(in.begin(), in.begin() + pos);
+            pos = 0;
+        }
+    }
+}
+
+static void replica_run() {
+    t_replicating = true;
+    while (true) {
+        int fd = repl_connect();
+        if (fd >= 0) {
+            fprintf(stderr, "connected to the primary\n");
+            replica_session(fd);
+            close(fd);
+            fprintf(stderr, "lost the primary at offset %lld\n", (long long)g_replica.offset);
+        }
+        sleep(1);
+    }
+}
+
+// ---- command table ----
+// one entry per command. dispatch hashes the name into a table that is laid
+// out at compile time: the constexpr search below picks a seed for which
+// every name lands in a slot of its own (a perfect hash), so finding a
+// command is one hash, one slot and one compare however many there are.
+
+enum {
+    CMD_READ = 1,  // reads the keyspace.
+    CMD_WRITE = 2, // changes it: logged, replicated, refused on a replica.
+    CMD_ADMIN = 4, // server management.
+    CMD_DENYOOM = 8, // may grow the keyspace: refused when over maxmemory.
+};
+
+static void do_info(vector<string_view> &cmd, OutBuf &out);
+static void do_slowlog(vector<string_view> &cmd, OutBuf &out);
+
+struct Command {
+    string_view name; // lowercase, matched case-insensitively.
+    int arity;        // the argument count with the name, -n: at least n.
+    uint32_t flags;
+    void (*handler)(vector<string_view> &cmd, OutBuf &out);
+};
+
+static constexpr Command k_commands[] = {
+    {"get", 2, CMD_READ, do_get},
+    {"set", 3, CMD_WRITE | CMD_DENYOOM, do_set},
+    {"del", 2, CMD_WRITE, do_del},
+    {"unlink", 2, CMD_WRITE, do_unlink},
+    {"mget", -2, CMD_READ, do_mget},
+    {"mset", -3, CMD_WRITE | CMD_DENYOOM, do_mset},
+    {"mdel", -2, CMD_WRITE, do_mdel},
+    {"incr", 2, CMD_WRITE | CMD_DENYOOM, do_incr},
+    {"decr", 2, CMD_WRITE | CMD_DENYOOM, do_decr},
+    {"incrby", 3, CMD_WRITE | CMD_DENYOOM, do_incrby},
+    {"decrby", 3, CMD_WRITE | CMD_DENYOOM, do_decrby},
+    {"keys", 1, CMD_READ, do_keys},
+    {"scan", -2, CMD_READ, do_scan},
+    {"zadd", 4, CMD_WRITE | CMD_DENYOOM, do_zadd},
+    {"zrem", 3, CMD_WRITE, do_zrem},
+    {"zscore", 3, CMD_READ, do_zscore},
+    {"zrank", 3, CMD_READ, do_zrank},
+    {"zrange", 6, CMD_READ, do_zrange},
+    {"expire", 3, CMD_WRITE, do_expire},
+    {"pexpire", 3, CMD_WRITE, do_pexpire},
+    {"pexpireat", 3, CMD_WRITE, do_pexpireat},
+    {"ttl", 2, CMD_READ, do_ttl},
+    {"persist", 2, CMD_WRITE, do_persist},
+    {"save", 1, CMD_ADMIN, do_save},
+    {"bgsave", 1, CMD_ADMIN, do_bgsave},
+    {"bgrewriteaof", 1, CMD_ADMIN, do_bgrewriteaof},
+    {"info", -1, CMD_ADMIN, do_info},
+    {"slowlog", -2, CMD_ADMIN, do_slowlog},
+};
+
+const size_t k_ncommands = sizeof(k_commands) / sizeof(k_commands[0]);
+const size_t k_cmd_slots = 256; // sparse, so a seed is found quickly.
+static_assert(k_ncommands < k_cmd_slots, "");
+
+// FNV-1a over the bytes with the ASCII case bit set: "GET" and "get" hash
+// the same. other bytes may collide this way, the final compare sorts it out.
+static constexpr uint32_t cmd_hash(string_view name, uint32_t seed) {
+    uint32_t h = seed;
+    for (char c : name) {
+        h = (h ^ (uint8_t)(c | 0x20)) * 16777619u;
+    }
+    return h;
+}
+
+struct CmdIndex {
+    uint32_t seed = 0;
+    uint8_t slot[k_cmd_slots] = {}; // 1 + index into k_commands, 0: empty.
+};
+
+static constexpr CmdIndex cmd_index_build() {
+    for (uint32_t seed = 2166136261u; seed < 2166136261u + 100000; seed++) {
+        CmdIndex idx;
+        idx.seed = seed;
+        bool ok = true;
+        for (size_t i = 0; i < k_ncommands && ok; i++) {
+            uint8_t &slot = idx.slot[cmd_hash(k_commands[i].name, seed) % k_cmd_slots];
+            ok = slot == 0;
+            slot = (uint8_t)(i + 1);
+        }
+        if (ok) {
+            return idx;
+        }
+    }
+    return CmdIndex{};
+}
+
+static constexpr CmdIndex k_cmd_index = cmd_index_build();
+static_assert(k_cmd_index.seed != 0, "no perfect hash for the command names, grow k_cmd_slots");
+
+static const Command *cmd_lookup(string_view name) {
+    uint8_t slot = k_cmd_index.slot[cmd_hash(name, k_cmd_index.seed) % k_cmd_slots];
+    if (!slot) {
+        return nullptr;
+    }
+    const Command *c = &k_commands[slot - 1];
+    if (c->name.size() != name.size() || strncasecmp(c->name.data(), name.data(), name.size()) != 0) {
+        return nullptr;
+    }
+    return c;
+}
+
+// the command for the request, or nullptr with an error written to `out`.
+static const Command *cmd_find(vector<string_view> &cmd, OutBuf &out) {
+    const Command *c = cmd.empty() ? nullptr : cmd_lookup(cmd[0]);
+    if (!c) {
+        out_err(out, ERR_UNKNOWN, "unknown command");
+        return nullptr;
+    }
+    size_t nargs = cmd.size();
+    if (c->arity >= 0 ? nargs != (size_t)c->arity : nargs < (size_t)-c->arity) {
+        out_err(out, ERR_BAD_ARG, "wrong number of arguments");
+        return nullptr;
+    }
+    return c;
+}
+
+// ---- stats ----
+// counters for INFO. every event-loop thread owns a Stats and is its only
+// writer, INFO sums them from whatever thread it runs on. the owner adds
+// with a plain load and store rather than a locked add, so the request path
+// pays no more than for an ordinary counter, and a reader sees values that
+// are at most a little behind.
+
+struct Counter {
+    std::atomic<uint64_t> v{0};
+
+    void add(uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t get() const {
+        return v.load(std::memory_order_relaxed);
+    }
+};
+
+// within 1/8 of the true value, 496 buckets.
+using LatHist = LogHistogram<4>;
+
+struct LatCounters {
+    Counter count;
+    Counter sum_ns;
+    Counter max_ns;
+    Counter buckets[LatHist::k_buckets];
+
+    void record(uint64_t ns) {
+        count.add(1);
+        sum_ns.add(ns);
+        buckets[LatHist::index(ns)].add(1);
+        if (ns > max_ns.get()) {
+            max_ns.v.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void sum_into(LatHist &h) const {
+        for (size_t i = 0; i < LatHist::k_buckets; i++) {
+            h.counts[i] += buckets[i].get();
+        }
+        h.total += count.get();
+        h.max = max(h.max, max_ns.get());
+    }
+};
+
+// rates are sampled this often by each worker.
+const uint64_t k_stats_sample_ms = 1000;
+
+struct CmdStats {
+    LatCounters lat; // around the handler, `count` is the number of calls.
+    Counter ops_sec;
+    uint64_t prev_calls = 0; // at the last sample, owner only.
+};
+
+struct Stats {
+    Counter bytes_in;
+    Counter bytes_out;
+    Counter accepted;
+    Counter closed;
+    Counter conn_mem; // Conn and its buffers, wraps around when it shrinks.
+    LatCounters loop; // one loop turn: from the wake-up to the next wait.
+    CmdStats cmds[k_ncommands];
+    uint64_t sample_ms = 0; // owner only.
+};
+
+static vector<Stats *> g_stats; // one per worker, filled in before they start.
+static thread_local Stats *t_stats = nullptr;
+static uint64_t g_start_ms = 0;
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// what a connection holds: the struct, its buffers and their bookkeeping.
+static size_t conn_buf_mem(const Conn *conn) {
+    return sizeof(Conn)
+         + (conn->incoming.buffer_end - conn->incoming.buffer_begin)
+         + (conn->outgoing.bytes.buffer_end - conn->outgoing.bytes.buffer_begin)
+         + conn->outgoing.segs.size() * sizeof(OutSeg)
+         + conn->args.capacity() * sizeof(string_view)
+         + conn->send_iov.capacity() * sizeof(struct iovec);
+}
+
+// after every event of the connection, and with mem = 0 when it is closed.
+static void conn_sync_mem(Conn *conn, size_t mem) {
+    if (mem != conn->mem) {
+        int64_t delta = (int64_t)mem - (int64_t)conn->mem;
+        t_stats->conn_mem.add((uint64_t)delta);
+        t_mem_delta += delta;
+        conn->mem = mem;
+    }
+}
+
+// ops/sec per command over the last sample period.
+static void stats_sample(Stats *st, uint64_t now_ms) {
+    uint64_t elapsed = now_ms - st->sample_ms;
+    if (elapsed < k_stats_sample_ms) {
+        return;
+    }
+    for (CmdStats &cs : st->cmds) {
+        uint64_t calls = cs.lat.count.get();
+        cs.ops_sec.v.store((calls - cs.prev_calls) * 1000 / elapsed, std::memory_order_relaxed);
+        cs.prev_calls = calls;
+    }
+    st->sample_ms = now_ms;
+}
+
+static void info_printf(string &s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void info_printf(string &s, const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    s.append(buf, min<size_t>(n, sizeof(buf) - 1));
+}
+
+static bool info_section(string_view want, string &s, const char *name) {
+    if (!want.empty() && (want.size() != strlen(name) || strncasecmp(want.data(), name, want.size()) != 0)) {
+        return false;
+    }
+    info_printf(s, "%s# %s\r\n", s.empty() ? "" : "\r\n", name);
+    return true;
+}
+
+// latencies are in ns, INFO reports usec.
+static double usec(uint64_t ns) {
+    return ns / 1000.0;
+}
+
+// INFO [section]: "key:value" lines grouped by "# section", like Redis.
+static void do_info(vector<string_view> &cmd, OutBuf &out) {
+    if (cmd.size() > 2) {
+        return out_err(out, ERR_BAD_ARG, "wrong number of arguments");
+    }
+    string_view want = cmd.size() == 2 ? cmd[1] : string_view();
+    uint64_t accepted = 0, closed = 0, bytes_in = 0, bytes_out = 0;
+    for (Stats *st : g_stats) {
+        accepted += st->accepted.get();
+        closed += st->closed.get();
+        bytes_in += st->bytes_in.get();
+        bytes_out += st->bytes_out.get();
+    }
+
+    string s;
+    if (info_section(want, s, "server")) {
+        info_printf(s, "uptime_sec:%llu\r\n", (unsigned long long)(get_monotonic_msec() - g_start_ms) / 1000);
+        info_printf(s, "threads:%d\r\n", g_config.nthreads);
+        info_printf(s, "role:%s\r\n", g_config.primary_host ? "replica" : "primary");
+    }
+    if (info_section(want, s, "clients")) {
+        info_printf(s, "connected_clients:%llu\r\n", (unsigned long long)(accepted - closed));
+        info_printf(s, "total_connections_received:%llu\r\n", (unsigned long long)accepted);
+    }
+    if (info_section(want, s, "stats")) {
+        uint64_t calls = 0, ops_sec = 0;
+        for (Stats *st : g_stats) {
+            for (CmdStats &cs : st->cmds) {
+                calls += cs.lat.count.get();
+                ops_sec += cs.ops_sec.get();
+            }
+        }
+        info_printf(s, "total_commands_processed:%llu\r\n", (unsigned long long)calls);
+        info_printf(s, "instantaneous_ops_per_sec:%llu\r\n", (unsigned long long)ops_sec);
+        info_printf(s, "total_net_input_bytes:%llu\r\n", (unsigned long long)bytes_in);
+        info_printf(s, "total_net_output_bytes:%llu\r\n", (unsigned long long)bytes_out);
+    }
+    if (info_section(want, s, "memory")) {
+        size_t slabs = 0, values = 0, tables = 0;
+        for (Shard &sh : g_db.shards) {
+            std::lock_guard<std::mutex> lock(sh.mu);
+            slabs += sh.slab.bytes_used;
+            values += sh.val_mem;
+            tables += sh.mem - sh.slab.bytes_used - sh.val_mem;
+        }
+        uint64_t conns = 0;
+        for (Stats *st : g_stats) {
+            conns += st->conn_mem.get();
+        }
+        mem_flush();
+        info_printf(s, "used_memory:%lld\r\n", (long long)g_mem_used.load(std::memory_order_relaxed));
+        info_printf(s, "used_memory_entries:%zu\r\n", slabs);
+        info_printf(s, "used_memory_values:%zu\r\n", values);
+        info_printf(s, "used_memory_tables:%zu\r\n", tables);
+        info_printf(s, "used_memory_clients:%lld\r\n", (long long)conns);
+        info_printf(s, "maxmemory:%llu\r\n", (unsigned long long)g_config.maxmemory);
+        info_printf(s, "maxmemory_policy:%s\r\n", k_evict_policies[g_config.maxmemory_policy]);
+        info_printf(s, "evicted_keys:%llu\r\n", (unsigned long long)g_evicted.load(std::memory_order_relaxed));
+    }
+    if (info_section(want, s, "keyspace")) {
+        size_t keys = 0, rehashing = 0;
+        string shards;
+        for (size_t i = 0; i < k_nshards; i++) {
+            Shard &sh = g_db.shards[i];
+            std::lock_guard<std::mutex> lock(sh.mu);
+            size_t n = hmap_size(&sh.hmap);
+            keys += n;
+            if (hmap_rehashing(&sh.hmap)) {
+                rehashing++;
+                info_printf(shards, "rehash_shard%zu:keys=%zu,migrate_pos=%zu\r\n",
+                            i, n, sh.hmap.migrate_pos);
+            }
+        }
+        info_printf(s, "keys:%zu\r\n", keys);
+        info_printf(s, "rehashing_shards:%zu\r\n", rehashing);
+        s += shards;
+    }
+    if (info_section(want, s, "loop")) {
+        for (size_t i = 0; i < g_stats.size(); i++) {
+            LatHist h;
+            g_stats[i]->loop.sum_into(h);
+            uint64_t sum = g_stats[i]->loop.sum_ns.get();
+            info_printf(s, "thread%zu:iterations=%llu,usec_per_iteration=%.2f,p99=%.2f,p99.9=%.2f,max=%.2f\r\n",
+                        i, (unsigned long long)h.total, h.total ? usec(sum) / h.total : 0.0,
+                        usec(h.percentile(99)), usec(h.percentile(99.9)), usec(h.max));
+        }
+    }
+    if (info_section(want, s, "commandstats")) {
+        for (size_t c = 0; c < k_ncommands; c++) {
+            LatHist h;
+            uint64_t sum = 0, ops_sec = 0;
+            for (Stats *st : g_stats) {
+                st->cmds[c].lat.sum_into(h);
+                sum += st->cmds[c].lat.sum_ns.get();
+                ops_sec += st->cmds[c].ops_sec.get();
+            }
+            if (h.total == 0) {
+                continue;
+            }
+            info_printf(s, "cmdstat_%.*s:calls=%llu,ops_sec=%llu,usec_per_call=%.2f,"
+                           "p50=%.2f,p99=%.2f,p99.9=%.2f,max=%.2f\r\n",
+                        (int)k_commands[c].name.size(), k_commands[c].name.data(),
+                        (unsigned long long)h.total, (unsigned long long)ops_sec, usec(sum) / h.total,
+                        usec(h.percentile(50)), usec(h.percentile(99)), usec(h.percentile(99.9)),
+                        usec(h.max));
+        }
+    }
+    out_str(out, s.data(), s.size());
+}
+
+// ---- slowlog ----
+// commands that ran longer than --slowlog-slower-than, and loop turns that
+// took longer than --loop-stall-usec: while a turn runs, every other client
+// of that thread waits. a stall is charged to the connection whose events
+// took the longest in the turn and to the slowest command. both are bounded
+// rings, newest first, only touched on the slow path.
+
+const size_t k_slowlog_max_args = 32;
+const size_t k_slowlog_max_arg_len = 128;
+
+struct SlowEntry {
+    uint64_t id = 0;
+    uint64_t time_sec = 0; // unix time.
+    uint64_t duration_us = 0;
+    vector<string> args; // truncated.
+    string client;
+};
+
+struct StallEntry {
+    uint64_t id = 0;
+    uint64_t time_sec = 0;
+    uint64_t duration_us = 0;
+    int thread = 0;
+    string conn;          // the connection that took the most time,
+    uint64_t conn_us = 0; // reading, running commands and writing.
+    string cmd;           // the slowest command and its client.
+    string cmd_client;
+    uint64_t cmd_us = 0;
+    uint64_t ncmds = 0; // all the commands of the turn.
+    uint64_t cmds_us = 0;
+};
+
+static struct {
+    std::mutex mu;
+    uint64_t next_id = 0;
+    deque<SlowEntry> entries;
+    uint64_t next_stall_id = 0;
+    deque<StallEntry> stalls;
+} g_slowlog;
+
+static void slowlog_add(const vector<string_view> &cmd, const char *client, uint64_t duration_ns) {
+    SlowEntry ent;
+    ent.time_sec = get_realtime_msec() / 1000;
+    ent.duration_us = duration_ns / 1000;
+    ent.client = client;
+    size_t nargs = min(cmd.size(), k_slowlog_max_args);
+    for (size_t i = 0; i < nargs; i++) {
+        string_view arg = cmd[i];
+        if (i == k_slowlog_max_args - 1 && cmd.size() > k_slowlog_max_args) {
+            ent.args.push_back("... (" + to_string(cmd.size() - i) + " more arguments)");
+        } else if (arg.size() > k_slowlog_max_arg_len) {
+            ent.args.emplace_back(arg.substr(0, k_slowlog_max_arg_len));
+            ent.args.back() += "... (" + to_string(arg.size() - k_slowlog_max_arg_len) + " more bytes)";
+        } else {
+            ent.args.emplace_back(arg);
+        }
+    }
+    std::lock_guard<std::mutex> lock(g_slowlog.mu);
+    ent.id = g_slowlog.next_id++;
+    g_slowlog.entries.push_front(std::move(ent));
+    while (g_slowlog.entries.size() > g_config.slowlog_max_len) {
+        g_slowlog.entries.pop_back();
+    }
+}
+
+// what one loop turn spent its time on. fixed buffers: it is updated for
+// every event, so it must not allocate.
+struct TurnTrace {
+    uint64_t start_ns = 0;
+    uint64_t mark_ns = 0;  // start of the event being handled.
+    char mark_addr[24] = {}; // its connection, empty for the listener.
+    uint64_t conn_ns = 0;
+    char conn_addr[24] = {};
+    uint64_t cmd_ns = 0;
+    char cmd[128] = {};
+    char cmd_addr[24] = {};
+    uint64_t ncmds = 0;
+    uint64_t cmds_ns = 0;
+};
+
+static thread_local TurnTrace t_turn;
+
+// "set key value", cut to fit the buffer.
+static void trace_command(char *dst, size_t cap, const vector<string_view> &cmd) {
+    size_t len = 0;
+    for (size_t i = 0; i < cmd.size() && len + 1 < cap; i++) {
+        if (i > 0) {
+            dst[len++] = ' ';
+        }
+        size_t n = min(cmd[i].size(), cap - 1 - len);
+        memcpy(dst + len, cmd[i].data(), n);
+        len += n;
+    }
+    dst[len] = '\0';
+    if (len + 1 == cap && cap > 4) {
+        memcpy(dst + cap - 4, "...", 4);
+    }
+}
+
+static void turn_begin(uint64_t now_ns) {
+    TurnTrace &t = t_turn;
+    t.start_ns = t.mark_ns = now_ns;
+    t.mark_addr[0] = '\0';
+    t.conn_ns = t.cmd_ns = t.ncmds = t.cmds_ns = 0;
+    t.conn_addr[0] = t.cmd[0] = t.cmd_addr[0] = '\0';
+}
+
+// the time since the last mark belongs to the previous event; `conn` owns
+// the next one (nullptr: none, or not a client).
+static void turn_mark(const Conn *conn, uint64_t now_ns) {
+    TurnTrace &t = t_turn;
+    uint64_t spent = now_ns - t.mark_ns;
+    if (t.mark_addr[0] && spent > t.conn_ns) {
+        t.conn_ns = spent;
+        memcpy(t.conn_addr, t.mark_addr, sizeof(t.conn_addr));
+    }
+    t.mark_ns = now_ns;
+    if (conn) {
+        memcpy(t.mark_addr, conn->addr, sizeof(t.mark_addr));
+    } else {
+        t.mark_addr[0] = '\0';
+    }
+}
+
+static void turn_command(const Conn *conn, const vector<string_view> &cmd, uint64_t spent) {
+    TurnTrace &t = t_turn;
+    t.ncmds++;
+    t.cmds_ns += spent;
+    if (spent > t.cmd_ns) {
+        t.cmd_ns = spent;
+        trace_command(t.cmd, sizeof(t.cmd), cmd);
+        memcpy(t.cmd_addr, conn->addr, sizeof(t.cmd_addr));
+    }
+}
+
+// returns the duration of the turn.
+static uint64_t turn_end(int thread, uint64_t now_ns) {
+    turn_mark(nullptr, now_ns);
+    TurnTrace &t = t_turn;
+    uint64_t spent = now_ns - t.start_ns;
+    if (!g_config.loop_stall_us || spent / 1000 < g_config.loop_stall_us) {
+        return spent;
+    }
+    fprintf(stderr, "loop stall: thread %d blocked for %llu us, %llu us on %s, slowest command %llu us from %s: %s\n",
+            thread, (unsigned long long)spent / 1000,
+            (unsigned long long)t.conn_ns / 1000, t.conn_addr[0] ? t.conn_addr : "-",
+            (unsigned long long)t.cmd_ns / 1000, t.cmd_addr[0] ? t.cmd_addr : "-", t.cmd);
+    StallEntry ent;
+    ent.time_sec = get_realtime_msec() / 1000;
+    ent.duration_us = spent / 1000;
+    ent.thread = thread;
+    ent.conn = t.conn_addr;
+    ent.conn_us = t.conn_ns / 1000;
+    ent.cmd = t.cmd;
+    ent.cmd_client = t.cmd_addr;
+    ent.cmd_us = t.cmd_ns / 1000;
+    ent.ncmds = t.ncmds;
+    ent.cmds_us = t.cmds_ns / 1000;
+    std::lock_guard<std::mutex> lock(g_slowlog.mu);
+    ent.id = g_slowlog.next_stall_id++;
+    g_slowlog.stalls.push_front(std::move(ent));
+    while (g_slowlog.stalls.size() > g_config.slowlog_max_len) {
+        g_slowlog.stalls.pop_back();
+    }
+    return spent;
+}
+
+static bool slowlog_count(vector<string_view> &cmd, OutBuf &out, size_t &count) {
+    count = 10;
+    if (cmd.size() == 3) {
+        int64_t n = 0;
+        if (!str2int(cmd[2], n) || n < 0) {
+            out_err(out, ERR_BAD_ARG, "expect a count");
+            return false;
+        }
+        count = (size_t)n;
+    }
+    return true;
+}
+
+// SLOWLOG GET [n] | STALLS [n] | LEN | RESET
+static void do_slowlog(vector<string_view> &cmd, OutBuf &out) {
+    string_view sub = cmd[1];
+    auto is = [&](const char *name) {
+        return sub.size() == strlen(name) && strncasecmp(sub.data(), name, sub.size()) == 0;
+    };
+    std::lock_guard<std::mutex> lock(g_slowlog.mu);
+    if (is("len") && cmd.size() == 2) {
+        return out_int(out, (int64_t)g_slowlog.entries.size());
+    }
+    if (is("reset") && cmd.size() == 2) {
+        g_slowlog.entries.clear();
+        g_slowlog.stalls.clear();
+        return out_nil(out);
+    }
+    size_t count = 0;
+    if (is("get") && cmd.size() <= 3) {
+        if (!slowlog_count(cmd, out, count)) {
+            return;
+        }
+        count = min(count, g_slowlog.entries.size());
+        // [id, unix time, usec, client, [args]]
+        out_array_header(out, (uint32_t)count);
+        for (size_t i = 0; i < count; i++) {
+            const SlowEntry &ent = g_slowlog.entries[i];
+            out_array_header(out, 5);
+            out_int(out, (int64_t)ent.id);
+            out_int(out, (int64_t)ent.time_sec);
+            out_int(out, (int64_t)ent.duration_us);
+            out_str(out, ent.client.data(), ent.client.size());
+            out_array_header(out, (uint32_t)ent.args.size());
+            for (const string &arg : ent.args) {
+                out_str(out, arg.data(), arg.size());
             }
-            if (conn->want_write)
-            {
-                pfd.events |= POLLOUT;
+        }
+        return;
+    }
+    if (is("stalls") && cmd.size() <= 3) {
+        if (!slowlog_count(cmd, out, count)) {
+            return;
+        }
+        count = min(count, g_slowlog.stalls.size());
+        // [id, unix time, usec, thread, connection, its usec,
+        //  slowest command, its client, its usec, commands, their usec]
+        out_array_header(out, (uint32_t)count);
+        for (size_t i = 0; i < count; i++) {
+            const StallEntry &ent = g_slowlog.stalls[i];
+            out_array_header(out, 11);
+            out_int(out, (int64_t)ent.id);
+            out_int(out, (int64_t)ent.time_sec);
+            out_int(out, (int64_t)ent.duration_us);
+            out_int(out, ent.thread);
+            out_str(out, ent.conn.data(), ent.conn.size());
+            out_int(out, (int64_t)ent.conn_us);
+            out_str(out, ent.cmd.data(), ent.cmd.size());
+            out_str(out, ent.cmd_client.data(), ent.cmd_client.size());
+            out_int(out, (int64_t)ent.cmd_us);
+            out_int(out, (int64_t)ent.ncmds);
+            out_int(out, (int64_t)ent.cmds_us);
+        }
+        return;
+    }
+    out_err(out, ERR_BAD_ARG, "expect GET [n], STALLS [n], LEN or RESET");
+}
+
+// ---- eviction ----
+// when used memory is over --maxmemory, keys are evicted before the next
+// command runs. there is no global LRU list to maintain on every access:
+// each eviction samples a few keys of one shard straight from its hash
+// table and drops the best candidate, which approximates LRU or LFU well
+// enough at a fraction of the cost, as in redis.
+
+static void evict_entry(Shard *sh, Entry *ent) {
+    entry_drop(sh, ent);
+    g_evicted.fetch_add(1, std::memory_order_relaxed);
+}
+
+// higher is a better victim.
+static uint64_t evict_score(Entry *ent) {
+    if (g_config.maxmemory_policy == EVICT_ALLKEYS_LFU) {
+        return 255 - lfu_counter(ent->access, lfu_minutes());
+    }
+    return (g_lru_clock.load(std::memory_order_relaxed) - ent->access) & 0xFFFFFFFF;
+}
+
+// volatile-ttl: the key closest to expiring, which is the top of a shard's
+// TTL heap. the shard is picked by next_expire, so this is exact.
+static bool evict_volatile_ttl() {
+    Shard *best = nullptr;
+    uint64_t best_expire = UINT64_MAX;
+    for (Shard &sh : g_db.shards) {
+        uint64_t next = sh.next_expire.load(std::memory_order_relaxed);
+        if (next < best_expire) {
+            best = &sh;
+            best_expire = next;
+        }
+    }
+    if (!best) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(best->mu);
+    if (best->ttl_heap.empty()) {
+        return true; // raced with another thread, look again.
+    }
+    evict_entry(best, container_of(best->ttl_heap[0].ref, Entry, ttl_idx));
+    return true;
+}
+
+// evicts one key. false if there is nothing left that the policy may evict.
+static bool evict_one() {
+    if (g_config.maxmemory_policy == EVICT_VOLATILE_TTL) {
+        return evict_volatile_ttl();
+    }
+    // the shards are equally loaded by the hash, any non-empty one will do.
+    size_t start = rand_u64() % k_nshards;
+    HashNode *sample[64];
+    size_t want = min<size_t>(g_config.maxmemory_samples, 64);
+    for (size_t i = 0; i < k_nshards; i++) {
+        Shard *sh = &g_db.shards[(start + i) % k_nshards];
+        std::lock_guard<std::mutex> lock(sh->mu);
+        size_t n = hmap_sample(&sh->hmap, rand_u64(), sample, want);
+        if (n == 0) {
+            continue;
+        }
+        Entry *victim = nullptr;
+        uint64_t victim_score = 0;
+        for (size_t j = 0; j < n; j++) {
+            Entry *ent = container_of(sample[j], Entry, node);
+            uint64_t score = evict_score(ent);
+            if (!victim || score > victim_score) {
+                victim = ent;
+                victim_score = score;
+            }
+        }
+        evict_entry(sh, victim);
+        return true;
+    }
+    return false;
+}
+
+// false if used memory stays over the limit. not on a replica, which
+// follows the evictions of its primary.
+static bool maxmemory_ok() {
+    if (!g_config.maxmemory || g_config.primary_host) {
+        return true;
+    }
+    mem_flush();
+    bool ok = true;
+    while ((uint64_t)max<int64_t>(g_mem_used.load(std::memory_order_relaxed), 0) > g_config.maxmemory) {
+        if (g_config.maxmemory_policy == EVICT_NONE || !evict_one()) {
+            ok = false;
+            break;
+        }
+        mem_flush();
+    }
+    garbage_release(true); // outside the shard locks.
+    return ok;
+}
+
+static void do_command(vector<string_view> &cmd,  OutBuf &out) {
+    if (const Command *c = cmd_find(cmd, out)) {
+        c->handler(cmd, out);
+    }
+    mem_flush();
+}
+
+static void do_request(Conn *conn, vector<string_view> &cmd,  OutBuf &out) {
+    const Command *c = cmd_find(cmd, out);
+    if (!c) {
+        return;
+    }
+    if (g_config.primary_host && (c->flags & CMD_WRITE)) {
+        return out_err(out, ERR_READONLY, "replica is read-only");
+    }
+    if (!maxmemory_ok() && (c->flags & CMD_DENYOOM)) {
+        return out_err(out, ERR_OOM, "command not allowed when used memory > 'maxmemory'");
+    }
+    uint64_t t0 = get_monotonic_nsec();
+    c->handler(cmd, out);
+    garbage_release(true); // every shard lock has been released by now.
+    mem_flush();
+    uint64_t spent = get_monotonic_nsec() - t0;
+    t_stats->cmds[c - k_commands].lat.record(spent);
+    turn_command(conn, cmd, spent);
+    if (g_config.slowlog_slower_than_us >= 0 && spent / 1000 >= (uint64_t)g_config.slowlog_slower_than_us) {
+        slowlog_add(cmd, conn->addr, spent);
+    }
+}
+
+
+// static void serialise_response(const Response &resp, vector<uint8_t> &out){
+//     uint32_t resp_len = 4 + (uint32_t) resp.payload.size(); // 4 for status , and then payload.
+//     append_to_buffer(out, (const uint8_t *)&resp_len, 4 );
+//     append_to_buffer(out , (const uint8_t *)& resp.status , 4);
+//     append_to_buffer(out , resp.payload.data()  , resp.payload.size());
+// }
+
+// where a response starts: its position in the pending output and in the
+// inline bytes, where the length gets patched in.
+struct RespHeader {
+    size_t pos = 0;
+    size_t inline_pos = 0;
+};
+
+static void start_serialise_response(OutBuf &out, RespHeader &header){
+    header.pos = out.total;
+    header.inline_pos = buf_len(&out.bytes);
+    // reserve space for total length - 4 bytes.
+    append_to_buffer_u32(out, 0);
+}
+
+static size_t response_payload_size(OutBuf &out , const RespHeader &header){
+    return out.total - header.pos - 4;
+}
+
+static void end_serialise_response(OutBuf &out, const RespHeader &header){
+    size_t total_msg_size = response_payload_size(out , header);
+    if(total_msg_size > k_max_msg){
+        // discard the whole message.
+        out_truncate(&out, header.pos + 4, header.inline_pos + 4);
+        string err_msg = "response too big";
+        out_err(out, ERR_TOO_BIG, err_msg.data(), err_msg.size());
+        total_msg_size = response_payload_size(out , header);
+    }
+    // fill in the total length of the message at the header.
+    uint32_t total_size_u32 = (uint32_t) total_msg_size;
+    memcpy(buf_data(&out.bytes) + header.inline_pos, &total_size_u32, 4);
+}
+
+// actually parses the data accoring to our protocol.
+static bool try_one_request(Conn *conn)
+{
+    if (buf_len(&conn->incoming) < 4)
+    {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, buf_data(&conn->incoming), 4);
+
+    if (len > k_max_msg)
+    {
+        msg("append_to_buffer() too long");
+        conn->want_close = true;
+        return false;
+    }
+
+    if (4 + len > buf_len(&conn->incoming))
+    {
+        // more data is yet to arrive
+        return false;
+    }
+
+    uint8_t *request = buf_data(&conn->incoming) + 4;
+
+    // ----- application level parsing ----
+    // views into conn->incoming, valid until the request is consumed below.
+    vector<string_view> &cmd = conn->args;
+    if(parse_request(request, len , cmd) < 0) {
+        msg("bad request");
+        conn->want_close = true;
+        return false;
+    }
+
+    if (cmd.size() == 3 && cmd[0] == "sync" && !g_config.primary_host) {
+        // a replica: the connection leaves the event loop, its socket
+        // lives on in the sender thread. whatever follows is dropped.
+        repl_attach(dup(conn->fd), cmd[1], cmd[2]);
+        conn->want_close = true;
+        return false;
+    }
+
+    // ---- execute and serialise -----
+
+    RespHeader header;
+    start_serialise_response (conn->outgoing, header);
+    do_request(conn, cmd, conn->outgoing);
+    end_serialise_response(conn->outgoing , header);
+
+    // remove request from incoming buffer.
+    buf_consume(&conn->incoming , 4 + len); // O(1), no memmove.
+
+    return true;
+}
+
+// bookkeeping after n bytes of the outgoing buffer reached the socket.
+static void handle_written(Conn *conn, size_t n) {
+    t_stats->bytes_out.add(n);
+    // remove consumed data from buffer.
+    out_consume(&conn->outgoing , n);
+
+    // if all data written -> readiness intention.
+    if(out_empty(&conn->outgoing)){
+        conn->want_read = true;
+        conn->want_write = false;
+    } // else continue write.
+}
+
+const size_t k_max_iov = 64;
+// blobs at least this big go out with MSG_ZEROCOPY when it is enabled,
+// below that the page pinning and completion handling cost more than a copy.
+const size_t k_zerocopy_min = 256 * 1024;
+
+// the kernel reports finished MSG_ZEROCOPY sends as ranges of sequence
+// numbers on the socket's error queue; the blobs can be released after that.
+static void conn_zerocopy_reap(Conn *conn) {
+    while (true) {
+        char control[128];
+        struct msghdr mh = {};
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        if (recvmsg(conn->fd, &mh, MSG_ERRQUEUE) < 0) {
+            return; // EAGAIN: drained.
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // completions are usually in order, but are not guaranteed to be.
+            auto &pending = conn->zc_pending;
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (it->first - serr->ee_info <= serr->ee_data - serr->ee_info) {
+                    blob_unref(it->second);
+                    it = pending.erase(it);
+                } else {
+                    ++it;
+                }
             }
-            poll_args.push_back(pfd);
         }
+    }
+}
+
+// returns true if the error readiness was only zerocopy completions.
+static bool conn_zerocopy_error(Conn *conn) {
+    if (conn->zc_pending.empty()) {
+        return false;
+    }
+    conn_zerocopy_reap(conn);
+    int err = 0;
+    socklen_t len = sizeof(err);
+    return getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+}
+
+static void handle_write(Conn *conn) {
+    assert(!out_empty(&conn->outgoing));
+    if (!aof_durable()) {
+        return; // appendfsync always: after the aof_flush() of this turn.
+    }
+    struct iovec iov[k_max_iov];
+    size_t split = g_config.zerocopy ? k_zerocopy_min : SIZE_MAX;
+    size_t niov = out_iovecs(&conn->outgoing, iov, k_max_iov, split);
+
+    const OutSeg &front = conn->outgoing.segs.front();
+    bool zerocopy = front.blob && front.len - front.off >= split;
+    ssize_t rv = 0;
+    if (zerocopy) {
+        // the big value alone, straight from its pages.
+        struct msghdr mh = {};
+        mh.msg_iov = iov;
+        mh.msg_iovlen = 1;
+        rv = sendmsg(conn->fd, &mh, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    } else {
+        rv = writev(conn->fd, iov, (int)niov);
+    }
+
+    if(rv < 0 && (errno == EAGAIN || errno == ENOBUFS)){
+        // data not ready now, try again in the next iteration.
+        return;
+    }
+    if(rv < 0){
+        msg("handle_write() failed");
+        conn->want_close = true;
+        return;
+    }
+    if (zerocopy) {
+        // keep the blob alive until the kernel is done with its pages.
+        blob_ref(front.blob);
+        conn->zc_pending.push_back({conn->zc_next++, front.blob});
+    }
+    handle_written(conn, size_t(rv));
+}
+
+static void handle_eof(Conn *conn)
+{
+    if (buf_empty(&conn->incoming))
+    {
+        msg("client closed connection");
+    }
+    else
+    {
+        msg("client closed connection with pending data");
+    }
+    conn->want_close = true;
+}
+
+// runs the parser over the incoming buffer, returns true if there is output to send.
+static bool handle_input(Conn *conn)
+{
+    // pipeling.
+    while (try_one_request(conn));
+
+    if(!out_empty(&conn->outgoing)){
+        conn->want_read= false;
+        conn->want_write= true;
+        return true;
+    }
+    return false;
+}
+
+const size_t k_read_chunk = 64 * 1024;
+
+static void handle_read(Conn *conn)
+{
+    // read straight into the free space of the incoming buffer.
+    buf_reserve(&conn->incoming, k_read_chunk);
+    ssize_t rv = read(conn->fd, buf_tail(&conn->incoming), buf_tail_room(&conn->incoming));
+
+    if (rv < 0 && errno == EAGAIN)
+    {
+        // no data available right now.
+        // eagain is a error code that means the operation cannot be completed immediately because it would block but may succeed later.
+        return;
+    }
+    if (rv < 0)
+    {
+        // actual error
+        msg("read() failed");
+        conn->want_close = true;
+        return;
+    }
+
+    // eof
+    if (rv == 0)
+    {
+        return handle_eof(conn);
+    }
+
+    buf_commit(&conn->incoming, (size_t)rv);
+    t_stats->bytes_in.add((size_t)rv);
+    // with appendfsync always, the replies wait for the end of the loop turn.
+    if (handle_input(conn) && aof_durable())
+    {
+        return handle_write(conn);
+    }
+}
+
+static uint32_t conn_interest(Conn *conn)
+{
+    uint32_t events = 0;
+    if (conn->want_read)
+    {
+        events |= EV_READ;
+    }
+    if (conn->want_write)
+    {
+        events |= EV_WRITE;
+    }
+    return events;
+}
+
+// only talk to the kernel when the application's intention has changed.
+static void conn_update_interest(EventLoop *loop, Conn *conn)
+{
+    uint32_t events = conn_interest(conn);
+    if (events != conn->ev_interest)
+    {
+        ev_mod(loop, conn->fd, events);
+        conn->ev_interest = events;
+    }
+}
+
+// each event-loop thread owns its listening socket, loop and connections.
+struct Worker
+{
+    int id = 0;
+    int listen_fd = -1;
+    EventLoop loop;
+    bool use_uring = false;
+    Uring ring; // replaces the readiness loop when io_uring is available.
+    vector<Conn *> fd2Conn;
+    DList idle_list; // connections, least recently active first.
+    size_t expire_shard = 0; // where the next expiration pass starts.
+    uint64_t accept_retry_ms = 0; // io_uring: when to re-arm a failed accept.
+    Stats stats;
+};
+
+// called on every I/O: moving the connection to the tail keeps the list
+// sorted by last activity, so the stale ones are always at the head.
+static void conn_touch(Worker *w, Conn *conn, uint64_t now)
+{
+    conn->last_active_ms = now;
+    dlist_detach(&conn->idle_node);
+    dlist_insert_before(&w->idle_list, &conn->idle_node);
+}
+
+static void worker_add_conn(Worker *w, Conn *conn)
+{
+    // add to fd2Conn
+    if (conn->fd >= (int)w->fd2Conn.size())
+    {
+        // important point to note: the second argument will just initialize the new elements to nullptr not all of them.
+        w->fd2Conn.resize(conn->fd + 1, nullptr);
+    }
+    assert(w->fd2Conn[conn->fd] == nullptr);
+    w->fd2Conn[conn->fd] = conn;
+    conn_touch(w, conn, get_monotonic_msec());
+    w->stats.accepted.add(1);
+}
+
+static void conn_destroy(Worker *w, Conn *conn)
+{
+    if (!w->use_uring)
+    {
+        ev_del(&w->loop, conn->fd);
+    }
+    close(conn->fd);
+    w->fd2Conn[conn->fd] = nullptr;
+    dlist_detach(&conn->idle_node);
+    conn_sync_mem(conn, 0);
+    delete conn;
+    w->stats.closed.add(1);
+}
+
+// SO_REUSEPORT would also let a second server bind the port, and the
+// kernel would split the clients between two keyspaces writing the same
+// files. a plain bind fails instead if anything is bound there already.
+static void port_check()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket() failed");
+    }
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_config.port);
+    addr.sin_addr.s_addr = htonl(0);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "cannot bind port %u: %s\n", g_config.port, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+}
+
+// every thread binds its own socket to the same port with SO_REUSEPORT,
+// the kernel then spreads incoming connections across the threads.
+static int listen_socket()
+{
+    int sockFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockFd < 0)
+    {
+        die("socket() failed");
+    }
+
+    int val = 1;
+    if (setsockopt(sockFd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0)
+    {
+        die("setsockopt() failed");
+    }
+    if (setsockopt(sockFd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0)
+    {
+        die("setsockopt(SO_REUSEPORT) failed");
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_config.port);
+    addr.sin_addr.s_addr = htonl(0); // wildcard address
+
+    int rv = bind(sockFd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rv < 0)
+    {
+        die("bind() failed");
+    }
+
+    // set the listening socket to non-blocking mode.
+    fd_set_nonblocking(sockFd);
+
+    rv = listen(sockFd, SOMAXCONN);
+    if (rv < 0)
+    {
+        die("listen() failed");
+    }
+    return sockFd;
+}
+
+// ---- timers ----
+// idle connections are per worker. keys, on the other hand, may be expired
+// by any worker: the one that set a deadline always wakes up for it, since
+// it derives its wait from every shard's next_expire; the others skip a
+// shard whose lock is taken.
+
+// keys deleted per loop turn, so a mass expiry is spread over many turns
+// instead of stalling the requests that are waiting.
+const size_t k_max_expire_work = 2000;
+
+// the wait timeout for the event loop: time until the nearest deadline.
+static int next_timer_ms(Worker *w)
+{
+    uint64_t next = UINT64_MAX;
+    if (g_save.child.load(std::memory_order_relaxed))
+    {
+        next = get_monotonic_msec() + 100; // poll for the forked child.
+    }
+    if (g_config.idle_timeout_ms && !dlist_empty(&w->idle_list))
+    {
+        Conn *conn = container_of(w->idle_list.next, Conn, idle_node);
+        next = min(next, conn->last_active_ms + g_config.idle_timeout_ms);
+    }
+    // a replica expires nothing itself, the primary sends a del.
+    for (size_t i = 0; i < k_nshards && !g_config.primary_host; i++)
+    {
+        next = min(next, g_db.shards[i].next_expire.load(std::memory_order_relaxed));
+    }
+    next = min(next, w->stats.sample_ms + k_stats_sample_ms);
+    if (w->accept_retry_ms)
+    {
+        next = min(next, w->accept_retry_ms);
+    }
+    if (next == UINT64_MAX)
+    {
+        return -1; // no timers.
+    }
+    uint64_t now = get_monotonic_msec();
+    return next > now ? (int)min<uint64_t>(next - now, INT_MAX) : 0;
+}
+
+static void conn_close(Worker *w, Conn *conn);
+
+static size_t expire_shard(Shard *sh, uint64_t now, size_t budget)
+{
+    std::unique_lock<std::mutex> lock(sh->mu, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        return 0; // another thread is in there, maybe expiring it.
+    }
+    size_t nworks = 0;
+    while (nworks < budget && !sh->ttl_heap.empty() && sh->ttl_heap[0].val <= now)
+    {
+        entry_drop(sh, container_of(sh->ttl_heap[0].ref, Entry, ttl_idx)); // also pops the heap.
+        nworks++;
+    }
+    return nworks;
+}
+
+static void process_timers(Worker *w)
+{
+    child_poll();
+    uint64_t now = get_monotonic_msec();
+    while (g_config.idle_timeout_ms && !dlist_empty(&w->idle_list))
+    {
+        Conn *conn = container_of(w->idle_list.next, Conn, idle_node);
+        if (conn->last_active_ms + g_config.idle_timeout_ms > now)
+        {
+            break; // the rest of the list is even more recent.
+        }
+        fprintf(stderr, "closing idle connection %d\n", conn->fd);
+        conn_close(w, conn);
+    }
+
+    size_t nworks = 0;
+    for (size_t i = 0; i < k_nshards && nworks < k_max_expire_work && !g_config.primary_host; i++)
+    {
+        Shard *sh = &g_db.shards[(w->expire_shard + i) % k_nshards];
+        if (sh->next_expire.load(std::memory_order_relaxed) <= now)
+        {
+            nworks += expire_shard(sh, now, k_max_expire_work - nworks);
+            garbage_release(true); // outside the shard lock.
+        }
+    }
+    w->expire_shard = (w->expire_shard + 1) % k_nshards;
+    stats_sample(&w->stats, now);
+}
+
+static void worker_run(Worker *w)
+{
+    t_stats = &w->stats;
+    ev_add(&w->loop, w->listen_fd, EV_READ);
+    vector<EvEvent> ready_events;
 
-        int rv = poll(poll_args.data(), nfds_t(poll_args.size()), -1);
+    while (true)
+    {
+        int rv = ev_wait(&w->loop, ready_events, next_timer_ms(w));
         // interrupted by some signal
         if (rv < 0 && errno == EINTR)
         {
@@ -507,56 +3603,489 @@ int main()
         // actual error.
         if (rv < 0)
         {
-            die("poll() failed");
+            die("ev_wait() failed");
         }
 
-        // handle new connections on the listening socket.
-        if (poll_args[0].revents)
+        turn_begin(get_monotonic_nsec());
+        uint64_t now = get_monotonic_msec();
+        lru_clock_update(now);
+        // only the ready fds are visited.
+        for (const EvEvent &ev : ready_events)
         {
-            if (Conn *conn = handle_accept_new_client(sockFd))
+            if (ev.fd == w->listen_fd)
             {
-                // add to fd2Conn
-                if (conn->fd >= (int)fd2Conn.size())
+                turn_mark(nullptr, get_monotonic_nsec());
+                // handle new connections on the listening socket.
+                if (Conn *conn = handle_accept_new_client(w->listen_fd))
                 {
-                    // important point to note: the second argument will just initialize the new elements to nullptr not all of them.
-                    fd2Conn.resize(conn->fd + 1, nullptr);
+                    worker_add_conn(w, conn);
+                    // registered once, updated only when the intention changes.
+                    conn->ev_interest = conn_interest(conn);
+                    ev_add(&w->loop, conn->fd, conn->ev_interest);
                 }
-                assert(fd2Conn[conn->fd] == nullptr);
-                fd2Conn[conn->fd] = conn;
-            }
-        }
-
-        // handling events on existing connections.
-        for (size_t i = 1; i < poll_args.size(); i++)
-        {
-            uint32_t ready = poll_args[i].revents;
-
-            if (ready == 0)
-            {
                 continue;
             }
-            Conn *conn = fd2Conn[poll_args[i].fd];
 
-            if (ready & POLLIN)
+            Conn *conn = w->fd2Conn[ev.fd];
+            turn_mark(conn, get_monotonic_nsec());
+            conn_touch(w, conn, now);
+            if (ev.events & EV_READ)
             {
                 // ready to read from client;
                 assert(conn->want_read);
                 handle_read(conn);
             }
-            if (ready & POLLOUT)
+            if ((ev.events & EV_WRITE) && !conn->want_close)
             {
                 // ready to write to client
                 assert(conn->want_write);
                 handle_write(conn);
             }
-            if ((ready & POLLERR) || conn->want_close)
+            if ((ev.events & EV_ERR) && !conn->want_close && conn_zerocopy_error(conn))
+            {
+                // only zerocopy completions on the error queue.
+                conn_update_interest(&w->loop, conn);
+                continue;
+            }
+            if ((ev.events & EV_ERR) || conn->want_close)
             {
                 // error or want to close the connection.
-                close(conn->fd);
-                fd2Conn[conn->fd] = nullptr;
-                delete conn;
+                conn_destroy(w, conn);
+                continue;
+            }
+            conn_update_interest(&w->loop, conn);
+            conn_sync_mem(conn, conn_buf_mem(conn));
+        }
+        turn_mark(nullptr, get_monotonic_nsec());
+        aof_flush(); // before the replies that were held back go out.
+        repl_notify();
+        process_timers(w);
+        mem_flush();
+        w->stats.loop.record(turn_end(w->id, get_monotonic_nsec()));
+    }
+}
+
+// ---- io_uring backend ----
+// completions instead of readiness: the same want_read/want_write state
+// machine decides which single operation (recv or send) a connection has in
+// flight. all SQEs queued while handling completions go to the kernel in the
+// next io_uring_enter, together with the wait.
+
+const unsigned k_uring_entries = 1024;
+const uint32_t k_uring_nbufs = 256;
+const uint32_t k_uring_buf_size = 16 * 1024;
+// a failed accept (EMFILE, ENFILE) is not retried before this: re-arming
+// right away fails the same way until a connection closes.
+const uint64_t k_accept_retry_ms = 100;
+
+enum
+{
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV = 2,
+    URING_OP_SEND = 3,
+};
+
+// Conn is heap allocated, so the low bits of its address carry the op.
+static uint64_t uring_udata(Conn *conn, uint64_t op)
+{
+    return (uint64_t)conn | op;
+}
+
+static struct io_uring_sqe *worker_sqe(Worker *w)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe)
+    {
+        die("io_uring_enter() failed");
+    }
+    return sqe;
+}
+
+static void uring_arm_accept(Worker *w)
+{
+    w->accept_retry_ms = 0;
+    uring_prep_accept_multishot(worker_sqe(w), w->listen_fd,
+                                uring_udata(nullptr, URING_OP_ACCEPT));
+}
+
+// queue the next operation for the connection, or retire it.
+static void uring_conn_next(Worker *w, Conn *conn)
+{
+    if (conn->want_close)
+    {
+        if (conn->io_inflight == 0)
+        {
+            conn_destroy(w, conn);
+        }
+        else
+        {
+            shutdown(conn->fd, SHUT_RDWR); // completes the pending op.
+        }
+        return;
+    }
+    if (conn->io_inflight > 0)
+    {
+        return;
+    }
+    struct io_uring_sqe *sqe = worker_sqe(w);
+    if (conn->want_write)
+    {
+        conn->send_iov.resize(k_max_iov);
+        size_t niov = out_iovecs(&conn->outgoing, conn->send_iov.data(), k_max_iov);
+        conn->send_msg = {};
+        conn->send_msg.msg_iov = conn->send_iov.data();
+        conn->send_msg.msg_iovlen = niov;
+        uring_prep_sendmsg(sqe, conn->fd, &conn->send_msg,
+                           uring_udata(conn, URING_OP_SEND));
+    }
+    else
+    {
+        assert(conn->want_read);
+        uring_prep_recv(sqe, conn->fd, uring_udata(conn, URING_OP_RECV));
+    }
+    conn->io_inflight++;
+}
+
+// closes the connection now, or with io_uring once its pending operation
+// has completed.
+static void conn_close(Worker *w, Conn *conn)
+{
+    dlist_detach(&conn->idle_node);
+    conn->want_close = true;
+    if (w->use_uring)
+    {
+        uring_conn_next(w, conn);
+    }
+    else
+    {
+        conn_destroy(w, conn);
+    }
+}
+
+static void uring_on_accept(Worker *w, const struct io_uring_cqe &cqe)
+{
+    if (cqe.res < 0)
+    {
+        msg("accept() failed");
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            w->accept_retry_ms = get_monotonic_msec() + k_accept_retry_ms;
+        }
+        return;
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+    {
+        uring_arm_accept(w); // the multishot accept was terminated.
+    }
+    struct sockaddr_in client_addr = {};
+    socklen_t client_len = sizeof(client_addr);
+    getpeername(cqe.res, (struct sockaddr *)&client_addr, &client_len);
+    Conn *conn = conn_new(cqe.res, client_addr);
+    worker_add_conn(w, conn);
+    uring_conn_next(w, conn);
+}
+
+static void uring_on_recv(Worker *w, Conn *conn, const struct io_uring_cqe &cqe)
+{
+    if (cqe.res > 0 && !conn->want_close)
+    {
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        buf_append(&conn->incoming, uring_buf(&w->ring, bid), (size_t)cqe.res);
+        w->stats.bytes_in.add((size_t)cqe.res);
+        handle_input(conn);
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+    {
+        uring_buf_recycle(&w->ring, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (cqe.res == 0 && !conn->want_close)
+    {
+        handle_eof(conn);
+    }
+    else if (cqe.res < 0 && cqe.res != -ENOBUFS && !conn->want_close)
+    {
+        // ENOBUFS: all provided buffers are busy, simply retry.
+        msg("recv() failed");
+        conn->want_close = true;
+    }
+}
+
+static void uring_on_send(Conn *conn, const struct io_uring_cqe &cqe)
+{
+    if (cqe.res < 0)
+    {
+        if (!conn->want_close)
+        {
+            msg("send() failed");
+        }
+        conn->want_close = true;
+        return;
+    }
+    handle_written(conn, (size_t)cqe.res);
+}
+
+static void worker_run_uring(Worker *w)
+{
+    t_stats = &w->stats;
+    uring_arm_accept(w);
+    struct io_uring_cqe cqe;
+
+    while (true)
+    {
+        // one syscall submits everything queued and waits for completions.
+        int rv = uring_submit_and_wait(&w->ring, next_timer_ms(w));
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && errno != ETIME)
+        {
+            die("io_uring_enter() failed");
+        }
+
+        turn_begin(get_monotonic_nsec());
+        uint64_t now = get_monotonic_msec();
+        lru_clock_update(now);
+        while (uring_pop_cqe(&w->ring, &cqe))
+        {
+            uint64_t op = cqe.user_data & 7;
+            Conn *conn = (Conn *)(cqe.user_data & ~(uint64_t)7);
+            turn_mark(conn, get_monotonic_nsec());
+            if (op == URING_OP_ACCEPT)
+            {
+                uring_on_accept(w, cqe);
+                continue;
+            }
+            conn->io_inflight--;
+            if (!conn->want_close)
+            {
+                conn_touch(w, conn, now);
+            }
+            if (op == URING_OP_RECV)
+            {
+                uring_on_recv(w, conn, cqe);
+            }
+            else
+            {
+                uring_on_send(conn, cqe);
+            }
+            if (!conn->want_close)
+            {
+                conn_sync_mem(conn, conn_buf_mem(conn));
+            }
+            uring_conn_next(w, conn);
+        }
+        turn_mark(nullptr, get_monotonic_nsec());
+        aof_flush(); // the sends are only submitted after this.
+        repl_notify();
+        process_timers(w);
+        if (w->accept_retry_ms && get_monotonic_msec() >= w->accept_retry_ms)
+        {
+            uring_arm_accept(w);
+        }
+        mem_flush();
+        w->stats.loop.record(turn_end(w->id, get_monotonic_nsec()));
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--poll] [--uring] [--zerocopy] [--threads N] [--idle-timeout SEC] [--dbfile PATH]\n"
+                    "       [--aof PATH] [--appendfsync always|everysec|no]\n"
+                    "       [--port N] [--replicaof HOST:PORT] [--repl-backlog MB]\n"
+                    "       [--slowlog-slower-than USEC] [--slowlog-max-len N] [--loop-stall-usec USEC]\n"
+                    "       [--maxmemory BYTES[k|m|g]] [--maxmemory-samples N]\n"
+                    "       [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|volatile-ttl]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--poll") == 0)
+        {
+            g_config.backend = EV_BACKEND_POLL;
+        }
+        else if (strcmp(argv[i], "--uring") == 0)
+        {
+            g_config.uring = true;
+        }
+        else if (strcmp(argv[i], "--zerocopy") == 0)
+        {
+            g_config.zerocopy = true;
+        }
+        else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc)
+        {
+            g_config.idle_timeout_ms = strtoull(argv[++i], nullptr, 10) * 1000;
+        }
+        else if (strcmp(argv[i], "--dbfile") == 0 && i + 1 < argc)
+        {
+            g_config.dbfile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--aof") == 0 && i + 1 < argc)
+        {
+            g_config.aof_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc)
+        {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "always") == 0)
+            {
+                g_config.appendfsync = AOF_FSYNC_ALWAYS;
+            }
+            else if (strcmp(policy, "everysec") == 0)
+            {
+                g_config.appendfsync = AOF_FSYNC_EVERYSEC;
+            }
+            else if (strcmp(policy, "no") == 0)
+            {
+                g_config.appendfsync = AOF_FSYNC_NO;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+        {
+            g_config.port = (uint16_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--replicaof") == 0 && i + 1 < argc)
+        {
+            // HOST:PORT
+            char *addr = argv[++i];
+            char *colon = strrchr(addr, ':');
+            if (!colon)
+            {
+                usage(argv[0]);
+            }
+            *colon = '\0';
+            g_config.primary_host = addr;
+            g_config.primary_port = (uint16_t)atoi(colon + 1);
+        }
+        else if (strcmp(argv[i], "--repl-backlog") == 0 && i + 1 < argc)
+        {
+            g_config.repl_backlog = strtoull(argv[++i], nullptr, 10) << 20; // MB
+        }
+        else if (strcmp(argv[i], "--slowlog-slower-than") == 0 && i + 1 < argc)
+        {
+            g_config.slowlog_slower_than_us = strtoll(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--slowlog-max-len") == 0 && i + 1 < argc)
+        {
+            g_config.slowlog_max_len = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--loop-stall-usec") == 0 && i + 1 < argc)
+        {
+            g_config.loop_stall_us = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc)
+        {
+            char *end = nullptr;
+            g_config.maxmemory = strtoull(argv[++i], &end, 10);
+            switch (tolower(*end))
+            {
+            case 'g': g_config.maxmemory <<= 10; // fallthrough
+            case 'm': g_config.maxmemory <<= 10; // fallthrough
+            case 'k': g_config.maxmemory <<= 10; break;
+            case '\0': break;
+            default: usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc)
+        {
+            const char *policy = argv[++i];
+            size_t n = sizeof(k_evict_policies) / sizeof(k_evict_policies[0]);
+            size_t p = 0;
+            while (p < n && strcmp(policy, k_evict_policies[p]) != 0)
+            {
+                p++;
+            }
+            if (p == n)
+            {
+                usage(argv[0]);
             }
+            g_config.maxmemory_policy = (int)p;
+        }
+        else if (strcmp(argv[i], "--maxmemory-samples") == 0 && i + 1 < argc)
+        {
+            // strtoll: strtoull would wrap "-1" to a huge sample count.
+            char *end = nullptr;
+            long long n = strtoll(argv[++i], &end, 10);
+            if (n < 1 || *end != '\0')
+            {
+                usage(argv[0]);
+            }
+            g_config.maxmemory_samples = (size_t)n;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            g_config.nthreads = atoi(argv[++i]);
+            if (g_config.nthreads < 1)
+            {
+                usage(argv[0]);
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+
+    port_check(); // before the files are touched.
+    printf("server up and running");
+    hash_seed_init();
+    lazyfree_start();
+    load_data();
+    mem_flush();
+    if (g_config.primary_host)
+    {
+        std::thread(replica_run).detach();
+    }
+    // a peer closing mid-write must not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+
+    g_start_ms = get_monotonic_msec();
+    vector<Worker> workers(g_config.nthreads);
+    for (int i = 0; i < g_config.nthreads; i++)
+    {
+        workers[i].id = i;
+        workers[i].stats.sample_ms = g_start_ms;
+        g_stats.push_back(&workers[i].stats);
+        workers[i].listen_fd = listen_socket();
+        if (g_config.uring)
+        {
+            workers[i].use_uring = uring_init(&workers[i].ring, k_uring_entries,
+                                              k_uring_nbufs, k_uring_buf_size);
+            if (!workers[i].use_uring)
+            {
+                msg("io_uring is not available, falling back to the readiness loop");
+                g_config.uring = false;
+            }
+        }
+        if (!workers[i].use_uring)
+        {
+            ev_init(&workers[i].loop, g_config.backend);
         }
     }
+    fprintf(stderr, "event loop backend: %s, threads: %d\n",
+            workers[0].use_uring ? "io_uring" : ev_backend_name(&workers[0].loop),
+            g_config.nthreads);
+
+    // the main thread runs worker 0.
+    vector<std::thread> threads;
+    for (int i = 1; i < g_config.nthreads; i++)
+    {
+        threads.emplace_back(workers[i].use_uring ? worker_run_uring : worker_run, &workers[i]);
+    }
+    if (workers[0].use_uring)
+    {
+        worker_run_uring(&workers[0]);
+    }
+    else
+    {
+        worker_run(&workers[0]);
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,85 @@
+#include <cassert>
+#include <cstdlib>
+#include "slab.hpp"
+
+// 16-byte steps up to 256, then 4 classes per doubling up to k_slab_max,
+// which keeps the rounding waste under 25% (12.5% on average).
+struct SlabClasses {
+    size_t size[64] = {};
+    uint8_t of[k_slab_max / 16 + 1] = {}; // (size + 15) / 16 -> class
+    uint8_t n = 0;
+
+    constexpr SlabClasses() {
+        for (size_t sz = 16; sz <= 256; sz += 16) {
+            size[n++] = sz;
+        }
+        for (size_t base = 256; base < k_slab_max; base *= 2) {
+            for (size_t i = 1; i <= 4; i++) {
+                size[n++] = base + base / 4 * i;
+            }
+        }
+        uint8_t cls = 0;
+        for (size_t i = 0; i <= k_slab_max / 16; i++) {
+            while (size[cls] < i * 16) {
+                cls++;
+            }
+            of[i] = cls;
+        }
+    }
+};
+
+static constexpr SlabClasses k_classes;
+
+uint8_t slab_class(size_t size) {
+    return size <= k_slab_max ? k_classes.of[(size + 15) / 16] : k_slab_large;
+}
+
+size_t slab_class_size(uint8_t cls) {
+    return cls == k_slab_large ? 0 : k_classes.size[cls];
+}
+
+void *slab_alloc(Slab *slab, size_t size, uint8_t *cls) {
+    *cls = slab_class(size);
+    if (*cls == k_slab_large) {
+        slab->bytes_used += size;
+        return malloc(size);
+    }
+    size_t bsize = k_classes.size[*cls];
+    slab->bytes_used += bsize;
+
+    if (slab->free_lists.empty()) {
+        slab->free_lists.resize(k_classes.n);
+    }
+    if (SlabFree *blk = slab->free_lists[*cls]) {
+        slab->free_lists[*cls] = blk->next;
+        return blk;
+    }
+    if (slab->bump_left < bsize) {
+        // the tail of the previous page is dropped, at most k_slab_max bytes.
+        slab->bump = (uint8_t *)malloc(k_slab_page);
+        slab->bump_left = k_slab_page;
+        slab->pages.push_back(slab->bump);
+    }
+    void *ptr = slab->bump;
+    slab->bump += bsize;
+    slab->bump_left -= bsize;
+    return ptr;
+}
+
+void slab_free(Slab *slab, void *ptr, size_t size, uint8_t cls) {
+    if (cls == k_slab_large) {
+        slab->bytes_used -= size;
+        return free(ptr);
+    }
+    assert(size <= k_classes.size[cls]);
+    slab->bytes_used -= k_classes.size[cls];
+    SlabFree *blk = (SlabFree *)ptr;
+    blk->next = slab->free_lists[cls];
+    slab->free_lists[cls] = blk;
+}
+
+Slab::~Slab() {
+    for (uint8_t *page : pages) {
+        free(page);
+    }
+}
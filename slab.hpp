@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// size-class allocator for small variable-sized blocks (keyspace entries).
+// blocks are carved from large pages and recycled through one free list per
+// class, so millions of small entries cost no per-block malloc header and
+// do not fragment the general heap. freed blocks are only reused by the
+// same class, pages are returned when the slab is destroyed.
+//
+// not thread safe: each keyspace shard owns one and uses it under its lock.
+
+const size_t k_slab_max = 8192;     // larger blocks go to malloc().
+const size_t k_slab_page = 256 * 1024;
+const uint8_t k_slab_large = 0xFF;  // class of a malloc()ed block.
+
+struct SlabFree {
+    SlabFree *next;
+};
+
+struct Slab {
+    std::vector<SlabFree *> free_lists; // one per class.
+    std::vector<uint8_t *> pages;
+    uint8_t *bump = nullptr;            // unused tail of the newest page.
+    size_t bump_left = 0;
+    size_t bytes_used = 0;              // handed out, including class rounding.
+
+    Slab() = default;
+    Slab(const Slab &) = delete;
+    Slab &operator=(const Slab &) = delete;
+    ~Slab();
+};
+
+// the class a block of `size` bytes is served from, k_slab_large if none.
+uint8_t slab_class(size_t size);
+// usable bytes of a block of class `cls` (0 for k_slab_large).
+size_t slab_class_size(uint8_t cls);
+void *slab_alloc(Slab *slab, size_t size, uint8_t *cls);
+// `size` as passed to slab_alloc().
+void slab_free(Slab *slab, void *ptr, size_t size, uint8_t cls);
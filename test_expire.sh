@@ -0,0 +1,73 @@
+#!/bin/sh
+# writes to keys that have just expired, then a restart from the aof: the
+# replay must end with the same values, so the expirations have to be in
+# the log. runs ./server on the client's port, 1234, which must be free.
+set -e
+
+dir=$(mktemp -d)
+pid=
+cleanup() {
+    [ -n "$pid" ] && kill $pid 2>/dev/null
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+start() {
+    ./server --dbfile "$dir/dump.ldb" --aof "$dir/log.aof" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+}
+
+stop() {
+    kill $pid
+    wait $pid 2>/dev/null || true
+    pid=
+}
+
+# the replies, one per line, to the commands on stdin.
+replies() {
+    ./client | grep '^> .' | sed 's/^> //'
+}
+
+check() {
+    if [ "$1" != "$2" ]; then
+        printf '%s: expected\n%s\ngot\n%s\n' "$3" "$2" "$1"
+        exit 1
+    fi
+}
+
+start
+got=$({
+    echo set k 5; echo pexpire k 200
+    echo zadd z 1 a; echo pexpire z 200
+    echo set a 1; echo pexpire a 100
+    sleep 0.5 # all three have expired.
+    echo incr k; echo ttl k
+    echo zadd z 2 b
+    echo incr a
+} | replies)
+check "$got" "(nil)
+1
+1
+1
+(nil)
+1
+1
+-1
+1
+1" "before the restart"
+
+stop
+start
+got=$({
+    echo get k; echo ttl k
+    echo zscore z a; echo zscore z b
+    echo get a
+} | replies)
+check "$got" "\"1\"
+-1
+(nil)
+2
+\"1\"" "after the restart"
+stop
+echo "test_expire: ok"
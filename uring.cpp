@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.hpp"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned load_acquire(unsigned *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned *p, unsigned v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static bool uring_setup_buffers(Uring *ring, uint32_t nbufs, uint32_t buf_size) {
+    size_t ring_sz = nbufs * sizeof(struct io_uring_buf);
+    void *br = mmap(nullptr, ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br == MAP_FAILED) {
+        return false;
+    }
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)br;
+    reg.ring_entries = nbufs;
+    reg.bgid = k_uring_bgid;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(br, ring_sz); // kernel older than 5.19.
+        return false;
+    }
+    ring->br = (struct io_uring_buf_ring *)br;
+    ring->bufs = (uint8_t *)malloc((size_t)nbufs * buf_size);
+    ring->nbufs = nbufs;
+    ring->buf_size = buf_size;
+    for (uint32_t i = 0; i < nbufs; i++) {
+        uring_buf_recycle(ring, (uint16_t)i);
+    }
+    return true;
+}
+
+// undoes a partial uring_init(): the mappings made so far (null if not
+// yet) and the ring fd.
+static bool uring_init_fail(Uring *ring, void *rings, size_t rings_sz,
+                            void *sqes, size_t sqes_sz) {
+    if (sqes) {
+        munmap(sqes, sqes_sz);
+    }
+    if (rings) {
+        munmap(rings, rings_sz);
+    }
+    close(ring->fd);
+    *ring = Uring{};
+    return false;
+}
+
+bool uring_init(Uring *ring, unsigned entries, uint32_t nbufs, uint32_t buf_size) {
+    struct io_uring_params p = {};
+    int fd = sys_setup(entries, &p);
+    if (fd < 0) {
+        return false; // ENOSYS, or blocked by a sandbox.
+    }
+    ring->fd = fd;
+    ring->ext_arg = p.features & IORING_FEAT_EXT_ARG;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        return uring_init_fail(ring, nullptr, 0, nullptr, 0);
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    uint8_t *ptr = (uint8_t *)mmap(nullptr, sz, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        return uring_init_fail(ring, nullptr, 0, nullptr, 0);
+    }
+    ring->sq_head = (unsigned *)(ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(ptr + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_array = (unsigned *)(ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)(ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(ptr + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+
+    size_t sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return uring_init_fail(ring, ptr, sz, nullptr, 0);
+    }
+    ring->sqes = (struct io_uring_sqe *)sqes;
+
+    // provided buffer rings and multishot accept both arrived in 5.19.
+    if (!uring_setup_buffers(ring, nbufs, buf_size)) {
+        return uring_init_fail(ring, ptr, sz, sqes, sqes_sz);
+    }
+    return true;
+}
+
+static int uring_submit(Uring *ring, unsigned min_complete, unsigned flags,
+                        void *arg, size_t argsz) {
+    store_release(ring->sq_tail, ring->sqe_tail);
+    unsigned n = ring->to_submit;
+    int rv = sys_enter(ring->fd, n, min_complete, flags, arg, argsz);
+    if (rv >= 0) {
+        ring->to_submit = 0;
+    } else if (errno == ETIME || errno == EINTR) {
+        // the submissions went through before the wait was cut short.
+        ring->to_submit = 0;
+    }
+    return rv;
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    while (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries) {
+        // the queue is full, hand it to the kernel first.
+        if (uring_submit(ring, 0, 0, nullptr, 0) < 0 && errno != EINTR) {
+            return nullptr; // retrying would spin on the same error.
+        }
+    }
+    unsigned idx = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+int uring_submit_and_wait(Uring *ring, int timeout_ms) {
+    if (timeout_ms < 0 || !ring->ext_arg) {
+        return uring_submit(ring, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+    struct __kernel_timespec ts = {};
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg = {};
+    arg.ts = (uint64_t)&ts;
+    return uring_submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                        &arg, sizeof(arg));
+}
+
+bool uring_pop_cqe(Uring *ring, struct io_uring_cqe *out) {
+    unsigned head = *ring->cq_head;
+    if (head == load_acquire(ring->cq_tail)) {
+        return false;
+    }
+    *out = ring->cqes[head & ring->cq_mask];
+    store_release(ring->cq_head, head + 1);
+    return true;
+}
+
+uint8_t *uring_buf(Uring *ring, uint16_t bid) {
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+void uring_buf_recycle(Uring *ring, uint16_t bid) {
+    // not br->bufs: the kernel's flex array macro adds an empty struct in
+    // front of it, which takes up space in C++ and shifts every entry.
+    struct io_uring_buf *bufs = (struct io_uring_buf *)ring->br;
+    struct io_uring_buf *buf = &bufs[ring->br_tail & (ring->nbufs - 1)];
+    buf->addr = (uint64_t)uring_buf(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT; // the kernel picks a provided buffer.
+    sqe->buf_group = k_uring_bgid;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+// a minimal io_uring wrapper on top of the raw syscalls (no liburing).
+// SQEs are queued locally and handed to the kernel in one io_uring_enter
+// per loop turn together with the wait for completions.
+struct Uring {
+    int fd = -1;
+    bool ext_arg = false; // kernel accepts a timeout in io_uring_enter.
+
+    // submission queue
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    unsigned sqe_tail = 0;  // local tail, published on submit.
+    unsigned to_submit = 0;
+
+    // completion queue
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe *cqes = nullptr;
+
+    // provided buffer ring for receives (buffer group 0).
+    struct io_uring_buf_ring *br = nullptr;
+    uint8_t *bufs = nullptr;
+    uint32_t nbufs = 0;
+    uint32_t buf_size = 0;
+    uint16_t br_tail = 0;
+};
+
+const uint16_t k_uring_bgid = 0;
+
+// returns false if io_uring (or the features we rely on) is not available.
+bool uring_init(Uring *ring, unsigned entries, uint32_t nbufs, uint32_t buf_size);
+// flushes the queue to the kernel when it is full, returns null with errno
+// set if that fails.
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+// submits everything queued and waits for at least one completion.
+// returns < 0 with errno set on error, ETIME on timeout.
+int uring_submit_and_wait(Uring *ring, int timeout_ms);
+bool uring_pop_cqe(Uring *ring, struct io_uring_cqe *out);
+
+uint8_t *uring_buf(Uring *ring, uint16_t bid);
+// hands a provided buffer back to the kernel.
+void uring_buf_recycle(Uring *ring, uint16_t bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+// the msghdr and its iovecs must stay valid until the SQE is submitted.
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data);
@@ -1,11 +1,20 @@
 #pragma once
 #include <vector>
+#include <deque>
 #include <string>
+#include <string_view>
 #include <cstdint>
 #include <cstdio>
 #include <cerrno>
 #include <cstdlib>
 #include "hashmap.hpp"
+#include "buffer.hpp"
+#include "outbuf.hpp"
+#include "slab.hpp"
+#include "zset.hpp"
+#include "heap.hpp"
+#include "list.hpp"
+#include <sys/socket.h>
 
 using namespace std;
 
@@ -19,9 +28,31 @@ struct Conn
     bool want_read = false;
     bool want_write = false;
     bool want_close = false;
+    uint32_t ev_interest = 0; // what is currently registered with the event loop.
+    uint32_t io_inflight = 0; // io_uring operations not yet completed.
     // buffered input and output
-    vector<uint8_t> incoming; // data to be parsed by the application
-    vector<uint8_t> outgoing; // responses generated by the application
+    Buffer incoming; // data to be parsed by the application
+    OutBuf outgoing; // responses generated by the application
+    vector<string_view> args; // parsed request, reused to avoid allocations
+    // io_uring sendmsg arguments, must stay valid until the send is submitted.
+    struct msghdr send_msg = {};
+    vector<struct iovec> send_iov;
+    // MSG_ZEROCOPY sends whose pages the kernel may still be reading.
+    uint32_t zc_next = 0; // sequence number of the next zerocopy send.
+    deque<pair<uint32_t, Blob *>> zc_pending;
+    // position in the worker's idle list, which is ordered by last activity.
+    DList idle_node;
+    uint64_t last_active_ms = 0;
+    char addr[24] = {}; // "ip:port" of the client, for the slowlog.
+    size_t mem = 0;     // buffer bytes, as last added to the used memory.
+
+    ~Conn()
+    {
+        for (auto &p : zc_pending)
+        {
+            blob_unref(p.second);
+        }
+    }
 };
 
 struct Response
@@ -30,11 +61,38 @@ struct Response
     vector<uint8_t> payload; // indicates the message content
 };
 
+// a stored pair is a single variable-sized block from the shard's slab:
+// this header, the key bytes, then the value bytes. values of
+// k_out_ref_min bytes or more stay in a refcounted Blob, so responses can
+// reference them, and the block holds the Blob pointer instead.
+enum {
+    T_STR = 0,  // bytes, a Blob * with ENT_BLOB, or an int64_t with ENT_INT.
+    T_ZSET = 1, // the value area is a ZSet *.
+};
+
+enum {
+    ENT_BLOB = 1, // the value area is a Blob *.
+    ENT_INT = 2,  // the value area is an int64_t, for strings that are integers.
+};
+
 struct Entry
 {
-    string key;
-    string val;
     HashNode node; // intrusive ds -> meant to be embedded not referenced.
+    uint32_t klen = 0;
+    uint32_t vlen = 0; // bytes in the value area.
+    uint32_t ttl_idx = k_heap_none; // position in the shard's TTL heap.
+    uint32_t access = 0; // for eviction: LRU clock or LFU counter, see entry_touch().
+    uint8_t cls = 0;   // slab size class of this block.
+    uint8_t type = T_STR;
+    uint8_t flags = 0;
+    char data[];       // key, then value.
+};
+
+// probe for hmap lookups, the key is borrowed from the request.
+struct LookupKey
+{
+    HashNode node;
+    string_view key;
 };
 
 enum
@@ -48,6 +106,10 @@ enum
 enum {
     ERR_UNKNOWN = 1,    // unknown command
     ERR_TOO_BIG = 2,    // response too big
+    ERR_BAD_TYP = 3,    // the key holds another type
+    ERR_BAD_ARG = 4,    // malformed argument
+    ERR_READONLY = 5,   // a write sent to a replica
+    ERR_OOM = 6,        // over maxmemory and nothing left to evict
 };
 
 /*
@@ -92,7 +154,7 @@ enum
 #define container_of(ptr, T, member) \
     ((T *)((char *)ptr - offsetof(T, member)))
 
-void die(const char *msg)
+static void die(const char *msg)
 {
     int err = errno;
     fprintf(stderr, "[%d] %s\n", err, msg);
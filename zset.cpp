@@ -0,0 +1,155 @@
+#include<cassert>
+#include<cstdlib>
+#include<cstring>
+#include<new>
+#include<string_view>
+#include"zset.hpp"
+#include"hash.hpp"
+
+#define container_of(ptr, T, member) \
+    ((T *)((char *)ptr - offsetof(T, member)))
+
+static ZNode* znode_new(const char* name, size_t len, double score){
+    ZNode* node = new (malloc(sizeof(ZNode) + len)) ZNode();
+    node->hmap.hCode = hash_bytes(name, len);
+    node->score = score;
+    node->len = len;
+    memcpy(node->name, name, len);
+    return node;
+}
+
+static void znode_del(ZNode* node){
+    free(node);
+}
+
+// probe for lookups by name.
+struct ZKey{
+    HashNode node;
+    const char* name = nullptr;
+    size_t len = 0;
+};
+
+static bool zkey_eq(HashNode* node, HashNode* key){
+    ZNode* znode = container_of(node, ZNode, hmap);
+    ZKey* zkey = container_of(key, ZKey, node);
+    return znode->len == zkey->len && memcmp(znode->name, zkey->name, zkey->len) == 0;
+}
+
+// (score, name) order.
+static bool zless(AVLNode* lhs, double score, const char* name, size_t len){
+    ZNode* zl = container_of(lhs, ZNode, tree);
+    if(zl->score != score){
+        return zl->score < score;
+    }
+    return std::string_view(zl->name, zl->len) < std::string_view(name, len);
+}
+
+static bool zless(AVLNode* lhs, AVLNode* rhs){
+    ZNode* zr = container_of(rhs, ZNode, tree);
+    return zless(lhs, zr->score, zr->name, zr->len);
+}
+
+static void tree_insert(ZSet* zset, ZNode* node){
+    AVLNode* parent = nullptr;
+    AVLNode** from = &zset->root;
+    while(*from){
+        parent = *from;
+        from = zless(&node->tree, parent) ? &parent->left : &parent->right;
+    }
+    *from = &node->tree;
+    node->tree.parent = parent;
+    zset->root = avl_fix(&node->tree);
+}
+
+static void zset_update(ZSet* zset, ZNode* node, double score){
+    if(node->score == score){
+        return;
+    }
+    zset->root = avl_del(&node->tree);
+    avl_init(&node->tree);
+    node->score = score;
+    tree_insert(zset, node);
+}
+
+bool zset_insert(ZSet* zset, const char* name, size_t len, double score){
+    if(ZNode* node = zset_lookup(zset, name, len)){
+        zset_update(zset, node, score);
+        return false;
+    }
+    ZNode* node = znode_new(name, len, score);
+    zset->name_bytes += len;
+    hmap_insert(&zset->hmap, &node->hmap);
+    tree_insert(zset, node);
+    return true;
+}
+
+ZNode* zset_lookup(ZSet* zset, const char* name, size_t len){
+    if(!zset->root){
+        return nullptr;
+    }
+    ZKey key;
+    key.node.hCode = hash_bytes(name, len);
+    key.name = name;
+    key.len = len;
+    HashNode* found = hmap_lookup(&zset->hmap, &key.node, zkey_eq);
+    return found ? container_of(found, ZNode, hmap) : nullptr;
+}
+
+void zset_delete(ZSet* zset, ZNode* node){
+    ZKey key;
+    key.node.hCode = node->hmap.hCode;
+    key.name = node->name;
+    key.len = node->len;
+    HashNode* found = hmap_delete(&zset->hmap, &key.node, zkey_eq);
+    assert(found == &node->hmap);
+    (void)found;
+    zset->root = avl_del(&node->tree);
+    zset->name_bytes -= node->len;
+    znode_del(node);
+}
+
+ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len){
+    AVLNode* found = nullptr;
+    for(AVLNode* node = zset->root; node;){
+        if(zless(node, score, name, len)){
+            node = node->right;
+        }else{
+            found = node; // candidate, look for a smaller one.
+            node = node->left;
+        }
+    }
+    return found ? container_of(found, ZNode, tree) : nullptr;
+}
+
+ZNode* znode_offset(ZNode* node, int64_t offset){
+    AVLNode* tnode = node ? avl_offset(&node->tree, offset) : nullptr;
+    return tnode ? container_of(tnode, ZNode, tree) : nullptr;
+}
+
+int64_t zset_rank(ZNode* node){
+    return avl_rank(&node->tree);
+}
+
+size_t zset_size(ZSet* zset){
+    return avl_cnt(zset->root);
+}
+
+size_t zset_mem(ZSet* zset){
+    return zset_size(zset) * sizeof(ZNode) + zset->name_bytes + hmap_mem(&zset->hmap);
+}
+
+static void tree_dispose(AVLNode* node){
+    if(!node){
+        return;
+    }
+    tree_dispose(node->left);
+    tree_dispose(node->right);
+    znode_del(container_of(node, ZNode, tree));
+}
+
+void zset_clear(ZSet* zset){
+    hmap_clear(&zset->hmap);
+    tree_dispose(zset->root);
+    zset->root = nullptr;
+    zset->name_bytes = 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include<cstddef>
+#include<cstdint>
+#include"avl.hpp"
+#include"hashmap.hpp"
+
+// sorted set: every member is indexed twice, by name in a HashMap for
+// point lookups, and by (score, name) in an order-statistic AVL tree for
+// ranges and ranks. one allocation per member holds both nodes and the name.
+struct ZSet{
+    AVLNode* root = nullptr;
+    HashMap hmap;
+    size_t name_bytes = 0; // of all members, for zset_mem().
+};
+
+struct ZNode{
+    AVLNode tree;
+    HashNode hmap;
+    double score = 0;
+    size_t len = 0;
+    char name[];
+};
+
+// returns true if the member was added, false if its score was updated.
+bool zset_insert(ZSet* zset, const char* name, size_t len, double score);
+ZNode* zset_lookup(ZSet* zset, const char* name, size_t len);
+// unlinks and frees the member.
+void zset_delete(ZSet* zset, ZNode* node);
+// the first member >= (score, name), nullptr if none.
+ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len);
+ZNode* znode_offset(ZNode* node, int64_t offset);
+int64_t zset_rank(ZNode* node);
+size_t zset_size(ZSet* zset);
+// bytes allocated for the members and the index, not counting the ZSet.
+size_t zset_mem(ZSet* zset);
+// frees every member, the set is empty afterwards.
+void zset_clear(ZSet* zset);